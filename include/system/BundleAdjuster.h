@@ -1,29 +1,20 @@
 #ifndef INCLUDE_BUNDLEADJUSTER
 #define INCLUDE_BUNDLEADJUSTER
 
-#include "system/CameraModel.h"
 #include "system/KeyFrame.h"
-#include <memory>
-#include <set>
-#include <sophus/se3.hpp>
 
 namespace fishdso {
 
 class BundleAdjuster {
 public:
-  BundleAdjuster(CameraModel *cam, const BundleAdjusterSettings &_settings);
+  virtual ~BundleAdjuster() {}
 
-  void addKeyFrame(KeyFrame *keyFrame);
-  void adjust(int maxNumIterations);
+  virtual void addKeyFrame(KeyFrame *keyFrame) = 0;
 
-private:
-  bool isOOB(const SE3 &worldToBase, const SE3 &worldToRef,
-             const OptimizedPoint &baseOP);
-  CameraModel *cam;
-  std::set<KeyFrame *> keyFrames;
-  KeyFrame *firstKeyFrame;
+  // should be called before the keyframe is destroyed
+  virtual void marginalizeKeyFrame(KeyFrame *keyFrame) = 0;
 
-  BundleAdjusterSettings settings;
+  virtual void adjust(int maxNumIterations) = 0;
 };
 
 } // namespace fishdso
@@ -8,6 +8,7 @@
 #include <Eigen/StdVector>
 #include <opencv2/core.hpp>
 #include <string>
+#include <type_traits>
 
 namespace fishdso {
 
@@ -16,21 +17,39 @@ class CameraModel {
 public:
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
+  // POLYNOMIAL is the omnidirectional model with the map polynomial of any
+  // degree, POLYNOMIAL_FIXED is the same with the default degree known at
+  // compile time. PINHOLE and EQUIDISTANT are given by the focal length only.
+  enum Type { POLYNOMIAL, POLYNOMIAL_FIXED, PINHOLE, EQUIDISTANT };
+
   CameraModel(int width, int height, double scale, const Vec2 &center,
               VecX unmapPolyCoeffs, const Settings::CameraModel &settings = {});
   CameraModel(int width, int height, const std::string &calibFileName,
               const Settings::CameraModel &settings = {});
   CameraModel(int width, int height, double f, double cx, double cy,
-              const Settings::CameraModel &settings = {});
+              Type type = PINHOLE, const Settings::CameraModel &settings = {});
+
+  // Calls func with std::integral_constant<Type, type>, so that func is
+  // instantiated for each camera type and the type is dispatched only once.
+  template <typename Func> decltype(auto) withType(Func &&func) const {
+    switch (type) {
+    case POLYNOMIAL_FIXED:
+      return func(std::integral_constant<Type, POLYNOMIAL_FIXED>());
+    case PINHOLE:
+      return func(std::integral_constant<Type, PINHOLE>());
+    case EQUIDISTANT:
+      return func(std::integral_constant<Type, EQUIDISTANT>());
+    default:
+      return func(std::integral_constant<Type, POLYNOMIAL>());
+    }
+  }
 
   template <typename T> Eigen::Matrix<T, 3, 1> unmap(const T *point) const {
     typedef Eigen::Matrix<T, 3, 1> Vec3t;
     typedef Eigen::Matrix<T, 2, 1> Vec2t;
-    typedef Eigen::Matrix<T, Eigen::Dynamic, 1> VecXt;
     Eigen::Map<const Vec2t> pt_(point);
     Vec2t pt = pt_;
 
-    VecXt p = unmapPolyCoeffs.cast<T>();
     Vec2t c = center.cast<T>();
 
     pt /= scale;
@@ -39,13 +58,15 @@ public:
     T rho2 = pt.squaredNorm();
     T rho1 = sqrt(rho2);
 
-    T z = p[0];
-    T rhoN = rho2;
-    for (int i = 1; i < unmapPolyDeg; i += 2) {
-      z += rhoN * p[i];
-      if (i + 1 < unmapPolyDeg)
-        z += rhoN * rho1 * p[i + 1];
-      rhoN *= rho2;
+    T z(0);
+    if (type == EQUIDISTANT) {
+      T f(unmapPolyCoeffs[0]);
+      z = rho2 > T(0) ? rho1 / tan(rho1 / f) : f;
+    } else {
+      // z = p_0 + rho^2 (p_1 + rho (p_2 + ...)), Horner's scheme
+      for (int i = unmapPolyDeg - 1; i >= 1; --i)
+        z = z * rho1 + T(unmapPolyCoeffs[i]);
+      z = T(unmapPolyCoeffs[0]) + rho2 * z;
     }
 
     Vec3t res(pt[0], pt[1], z);
@@ -55,21 +76,31 @@ public:
   template <typename T> Eigen::Matrix<T, 2, 1> map(const T *point) const {
     typedef Eigen::Matrix<T, 3, 1> Vec3t;
     typedef Eigen::Matrix<T, 2, 1> Vec2t;
-    typedef Eigen::Matrix<T, Eigen::Dynamic, 1> VecXt;
 
     Eigen::Map<const Vec3t> pt_(point);
     Vec3t pt = pt_;
-    VecXt p = mapPolyCoeffs.cast<T>();
+    Vec2t c = center.cast<T>();
+
+    if (type == PINHOLE) {
+      if (pt[2] <= T(0))
+        return Vec2t(T(-1), T(-1));
+      Vec2t res = pt.template head<2>() * (T(unmapPolyCoeffs[0]) / pt[2]);
+      res += c;
+      res *= T(scale);
+      return res;
+    }
 
     T angle = atan2(pt.template head<2>().norm(), pt[2]);
-    T r = p[0];
-    T angleN = angle;
-    for (int i = 1; i < p.rows(); ++i) {
-      r += p[i] * angleN;
-      angleN *= angle;
+    T r;
+    if (type == EQUIDISTANT)
+      r = T(unmapPolyCoeffs[0]) * angle;
+    else {
+      int deg = mapPolyCoeffs.rows() - 1;
+      r = T(mapPolyCoeffs[deg]);
+      for (int i = deg - 1; i >= 0; --i)
+        r = r * angle + T(mapPolyCoeffs[i]);
     }
 
-    Vec2t c = center.cast<T>();
     Vec2t res = pt.template head<2>().normalized() * r;
     res += c;
     res *= T(scale);
@@ -81,28 +112,93 @@ public:
   }
 
   EIGEN_STRONG_INLINE Vec2 map(const Vec3 &ray) const {
-    return map(ray.data());
+    return withType(
+        [&](auto type) { return mapAs<decltype(type)::value>(ray); });
+  }
+
+  // map and diffMap for the camera type known at compile time, which must be
+  // the type of this camera. Points that are behind a pinhole camera are
+  // mapped to (-1, -1), which is never on the image.
+  template <Type modelType>
+  EIGEN_STRONG_INLINE Vec2 mapAs(const Vec3 &ray) const {
+    if constexpr (modelType == PINHOLE) {
+      if (ray[2] <= 0)
+        return Vec2(-1, -1);
+      return scale *
+             (center + (unmapPolyCoeffs[0] / ray[2]) * ray.head<2>());
+    } else {
+      double rho = ray.head<2>().norm();
+      if (rho == 0)
+        return scale * center;
+      double r = mapRadius<modelType>(std::atan2(rho, ray[2]), nullptr);
+      return scale * (center + (r / rho) * ray.head<2>());
+    }
   }
 
-  template <typename T>
-  cv::Mat undistort(const cv::Mat &img, const Mat33 &cameraMatrix) const {
-    Mat33 Kinv = cameraMatrix.inverse();
-    cv::Mat result = cv::Mat::zeros(img.rows, img.cols, img.type());
-
-    for (int y = 0; y < result.rows; ++y)
-      for (int x = 0; x < result.cols; ++x) {
-        Vec3 pnt(double(x), double(y), 1.);
-        Vec2 origPix = map(Kinv * pnt);
-        int origX = origPix[0], origY = origPix[1];
-        if (origX >= 0 && origX < result.cols && origY >= 0 &&
-            origY < result.rows)
-          result.at<T>(y, x) = img.at<T>(origY, origX);
+  template <Type modelType>
+  EIGEN_STRONG_INLINE std::pair<Vec2, Mat23> diffMapAs(const Vec3 &ray) const {
+    Mat23 mapJacobian;
+    if constexpr (modelType == PINHOLE) {
+      double z = ray[2];
+      if (z <= 0)
+        return {Vec2(-1, -1), Mat23::Zero()};
+      Vec2 xy = ray.head<2>() / z;
+      mapJacobian << 1, 0, -xy[0], 0, 1, -xy[1];
+      mapJacobian *= scale * unmapPolyCoeffs[0] / z;
+      return {scale * (center + unmapPolyCoeffs[0] * xy), mapJacobian};
+    } else {
+      // map(v) = scale * (center + r(theta) * u), where u = (x, y) / rho,
+      // rho = |(x, y)| and theta = atan2(rho, z)
+      double rho = ray.head<2>().norm();
+      double z = ray[2];
+      double dr;
+      double r = mapRadius<modelType>(std::atan2(rho, z), &dr);
+
+      if (rho < 1e-12 * std::abs(z)) {
+        // on the axis r(theta) / rho -> r'(0) / z
+        mapJacobian.leftCols<2>() = (scale * dr / z) * Mat22::Identity();
+        mapJacobian.col(2).setZero();
+        return {scale * center, mapJacobian};
       }
-    return result;
+
+      Vec2 u = ray.head<2>() / rho;
+      double n2 = rho * rho + z * z;
+      Mat22 uut = u * u.transpose();
+      mapJacobian.leftCols<2>() =
+          scale *
+          ((dr * z / n2) * uut + (r / rho) * (Mat22::Identity() - uut));
+      mapJacobian.col(2) = (-scale * dr * rho / n2) * u;
+      return {scale * (center + r * u), mapJacobian};
+    }
+  }
+
+  // Approximates unmap(point).normalized() by looking the ray up in the
+  // precomputed table with bilinear interpolation when the table is built and
+  // the point is on the image.
+  EIGEN_STRONG_INLINE Vec3 unmapUnit(const Vec2 &point) const {
+    if (!rayTable || !(point[0] >= 0 && point[0] < width && point[1] >= 0 &&
+                       point[1] < height))
+      return unmap(point).normalized();
+    int x = int(point[0]), y = int(point[1]);
+    float dx = point[0] - x, dy = point[1] - y;
+    const Vec3f *row = rayTable->data() + y * (width + 1) + x;
+    const Vec3f *nextRow = row + (width + 1);
+    Vec3f ray = (1 - dy) * ((1 - dx) * row[0] + dx * row[1]) +
+                dy * ((1 - dx) * nextRow[0] + dx * nextRow[1]);
+    return ray.cast<double>();
   }
 
-  std::pair<Vec2, Mat23> diffMap(const Vec3 &ray) const;
+  // Project or unproject whole point sets at once. The polynomials are
+  // evaluated over contiguous arrays, which lets Eigen vectorize them.
+  void mapBatch(const StdVector<Vec3> &rays, StdVector<Vec2> &points) const;
+  void unmapBatch(const StdVector<Vec2> &points, StdVector<Vec3> &rays) const;
 
+  EIGEN_STRONG_INLINE std::pair<Vec2, Mat23> diffMap(const Vec3 &ray) const {
+    return withType(
+        [&](auto type) { return diffMapAs<decltype(type)::value>(ray); });
+  }
+
+  EIGEN_STRONG_INLINE Type getType() const { return type; }
   EIGEN_STRONG_INLINE int getWidth() const { return width; }
   EIGEN_STRONG_INLINE int getHeight() const { return height; }
   EIGEN_STRONG_INLINE Vec2 getImgCenter() const { return scale * center; }
@@ -114,13 +210,38 @@ public:
   void getRectByAngle(double observeAngle, int &width, int &height) const;
 
   void setMapPolyCoeffs();
+  void setRayTable();
 
   StdVector<CameraModel> camPyr(int pyrLevels);
 
 private:
   friend std::istream &operator>>(std::istream &is, CameraModel &cc);
 
+  // r(theta) of the non-pinhole models and, if dr is not null, its derivative
+  template <Type modelType>
+  EIGEN_STRONG_INLINE double mapRadius(double angle, double *dr) const {
+    if constexpr (modelType == EQUIDISTANT) {
+      if (dr)
+        *dr = unmapPolyCoeffs[0];
+      return unmapPolyCoeffs[0] * angle;
+    } else {
+      constexpr bool isFixed = modelType == POLYNOMIAL_FIXED;
+      const int deg = isFixed ? Settings::CameraModel::default_mapPolyDegree
+                              : mapPolyCoeffs.rows() - 1;
+      double r = mapPolyCoeffs[deg], d = 0;
+      for (int i = deg - 1; i >= 0; --i) {
+        d = d * angle + r;
+        r = r * angle + mapPolyCoeffs[i];
+      }
+      if (dr)
+        *dr = d;
+      return r;
+    }
+  }
+
   EIGEN_STRONG_INLINE double calcUnmapPoly(double r) const {
+    if (type == EQUIDISTANT)
+      return r > 0 ? r / std::tan(r / unmapPolyCoeffs[0]) : unmapPolyCoeffs[0];
     double rN = r * r;
     double res = unmapPolyCoeffs[0];
     for (int i = 1; i < unmapPolyDeg; ++i) {
@@ -130,17 +251,21 @@ private:
     return res;
   }
   EIGEN_STRONG_INLINE double calcMapPoly(double funcVal) const {
-    double funcValN = funcVal;
-    double res = mapPolyCoeffs[0];
-    for (int i = 1; i < mapPolyCoeffs.rows(); ++i) {
-      res += mapPolyCoeffs[i] * funcValN;
-      funcValN *= funcVal;
-    }
+    int deg = mapPolyCoeffs.rows() - 1;
+    double res = mapPolyCoeffs[deg];
+    for (int i = deg - 1; i >= 0; --i)
+      res = res * funcVal + mapPolyCoeffs[i];
     return res;
   }
 
+  // normalizes the intrinsics and fits the map polynomial, or loads the
+  // result from the calibration cache if Settings::CameraModel::cacheDirectory
+  // is set
+  void calibrate();
+  bool loadCalibration(const fs::path &fileName, uint64_t key);
   void normalize();
 
+  Type type;
   int width, height;
   int unmapPolyDeg;
   VecX unmapPolyCoeffs;
@@ -150,7 +275,14 @@ private:
   double minZ;
   double maxAngle;
 
-  VecX mapPolyCoeffs;
+  // fixed capacity, so that the coefficients are stored inside the camera
+  Eigen::Matrix<double, Eigen::Dynamic, 1, 0,
+                Settings::CameraModel::max_mapPolyDegree + 1, 1>
+      mapPolyCoeffs;
+
+  // unit rays at integer points of [0, width] x [0, height], row-major; shared
+  // between copies of the same camera
+  std::shared_ptr<const std::vector<Vec3f>> rayTable;
 
   Settings::CameraModel settings;
 };
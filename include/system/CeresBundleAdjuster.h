@@ -0,0 +1,49 @@
+#ifndef INCLUDE_CERESBUNDLEADJUSTER
+#define INCLUDE_CERESBUNDLEADJUSTER
+
+#include "system/BundleAdjuster.h"
+#include "system/CameraModel.h"
+#include "system/KeyFrame.h"
+#include <memory>
+#include <set>
+#include <sophus/se3.hpp>
+
+namespace fishdso {
+
+// Keeps the optimization problem between calls to adjust: only residuals of
+// new keyframes, newly activated points and marginalized keyframes are added
+// or removed, and the solver starts from the previous solution. Marginalized
+// keyframes are simply dropped from the problem.
+class CeresBundleAdjuster : public BundleAdjuster {
+public:
+  CeresBundleAdjuster(CameraModel *cam,
+                      const BundleAdjusterSettings &_settings);
+  ~CeresBundleAdjuster();
+
+  void addKeyFrame(KeyFrame *keyFrame) override;
+  void marginalizeKeyFrame(KeyFrame *keyFrame) override;
+  void adjust(int maxNumIterations) override;
+
+private:
+  struct Internals;
+
+  bool isOOB(const SE3 &worldToBase, const SE3 &worldToRef,
+             const OptimizedPoint &baseOP);
+  void updateGauge();
+  void updateResiduals();
+  void addResiduals(KeyFrame *baseFrame, KeyFrame *refFrame,
+                    OptimizedPoint *optimizedPoint);
+  void removeResiduals(OptimizedPoint *optimizedPoint, KeyFrame *refFrame);
+
+  CameraModel *cam;
+  std::vector<KeyFrame *> keyFrames;
+  KeyFrame *firstKeyFrame;
+  KeyFrame *secondKeyFrame;
+  std::unique_ptr<Internals> internals;
+
+  BundleAdjusterSettings settings;
+};
+
+} // namespace fishdso
+
+#endif
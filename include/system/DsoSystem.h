@@ -11,13 +11,23 @@
 #include "util/DistanceMap.h"
 #include "util/PlyHolder.h"
 #include "util/settings.h"
+#include <condition_variable>
+#include <deque>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <opencv2/core.hpp>
 #include <optional>
+#include <thread>
 
 namespace fishdso {
 
+// If settings.backgroundMapping is set, addFrame returns as soon as the frame
+// is tracked. Point tracing, keyframe creation and bundle adjustment are then
+// done by a mapping thread, which hands a new FrameTracker over to tracking
+// after each keyframe. In this case DsoObserver::newKeyFrame and
+// keyFramesMarginalized are called from the mapping thread, and waitForMapping
+// should be called before inspecting the keyframes from the outside.
 class DsoSystem {
 public:
   DsoSystem(CameraModel *cam, const Observers &observers = {},
@@ -28,6 +38,8 @@ public:
 
   std::shared_ptr<PreKeyFrame> addFrame(const cv::Mat &frame,
                                         int globalFrameNum);
+  // blocks until all of the added frames are processed by the mapping thread
+  void waitForMapping();
   template <typename PointT>
   void projectOntoBaseKf(StdVector<Vec2> *points, std::vector<double> *depths,
                          std::vector<PointT *> *ptrs,
@@ -35,7 +47,7 @@ public:
 
   void addFrameTrackerObserver(FrameTrackerObserver *observer);
 
-  void saveSnapshot(const std::string &snapshotDir) const;
+  void saveSnapshot(const std::string &snapshotDir);
 
   // output only
   KeyFrame *lastInitialized;
@@ -55,6 +67,11 @@ private:
     return settings.trackFromLastKf ? lastKeyFrame() : lboKeyFrame();
   }
 
+  struct MappingTask {
+    std::shared_ptr<PreKeyFrame> frame;
+    bool needNewKf;
+  };
+
   double getTimeLastByLbo();
   SE3 predictInternal(double timeLastByLbo, const SE3 &baseToLbo,
                       const SE3 &baseToLast);
@@ -64,13 +81,20 @@ private:
   void adjustWorldToFrameSizes(int newFrameNum);
 
   bool didTrackFail();
-  std::pair<SE3, AffineLightTransform<double>>
-  recoverTrack(PreKeyFrame *lastFrame);
+  std::pair<SE3, AffineLightTransform<double>> recoverTrack(
+      PreKeyFrame *lastFrame,
+      const std::pair<SE3, AffineLightTransform<double>> &firstAttempt);
 
   bool doNeedKf(PreKeyFrame *lastFrame);
   void marginalizeFrames();
   void activateNewOptimizedPoints();
 
+  void mapFrame(const std::shared_ptr<PreKeyFrame> &preKeyFrame,
+                bool needNewKf);
+  void publishFrameTracker();
+  void takeNewFrameTracker();
+  void mappingLoop();
+
   CameraModel *cam;
   StdVector<CameraModel> camPyr;
 
@@ -79,13 +103,38 @@ private:
   std::unique_ptr<DsoInitializer> dsoInitializer;
   bool isInitialized;
 
+  // owned by tracking
   std::unique_ptr<FrameTracker> frameTracker;
+  KeyFrame *trackingBase;
+  SE3 trackingBaseToWorld;
+  int lastKeyFrameNum;
 
+  // handed over from mapping to tracking
+  std::unique_ptr<FrameTracker> newFrameTracker;
+  KeyFrame *newTrackingBase;
+  SE3 newTrackingBaseToWorld;
+
+  // owned by mapping
   StdMap<int, KeyFrame> keyFrames;
+  // indexed by the thread index in the tracing arena
+  std::vector<ImmaturePoint::TracingContext> tracingContexts;
+
+  std::unique_ptr<BundleAdjuster> bundleAdjuster;
 
   std::vector<int> frameNumbers;
+  // guarded by posesMutex
   StdVector<SE3> worldToFrame;
   StdVector<SE3> worldToFramePredict;
+  std::mutex posesMutex;
+
+  // guarded by mappingMutex
+  std::deque<MappingTask> mappingQueue;
+  int pendingKeyFrames;
+  bool isMapping;
+  bool stopMapping;
+  std::mutex mappingMutex;
+  std::condition_variable mappingCondition;
+  std::thread mappingThread;
 
   AffineLightTransform<double> lightKfToLast;
 
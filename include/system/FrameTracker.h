@@ -21,6 +21,26 @@ public:
   trackFrame(const PreKeyFrame &frame, const SE3 &coarseBaseToTracked,
              const AffineLightTransform<double> &coarseAffLight);
 
+  // Tracks the frame on the pyramid levels from the coarsest one down to
+  // minPyrLevel. Neither lastRmse nor the observers are touched, so several
+  // motion hypotheses may be tracked concurrently. energy is the mean Huber
+  // energy over all the points of minPyrLevel, where the points projected out
+  // of the image count as outliers, so that hypotheses which lose most of the
+  // points cannot win on the few that remain.
+  std::pair<SE3, AffineLightTransform<double>>
+  trackFrameCoarse(const PreKeyFrame &frame, const SE3 &coarseBaseToTracked,
+                   const AffineLightTransform<double> &coarseAffLight,
+                   int minPyrLevel, double *energy) const;
+
+  // Tracks the frame coarsely from each of the motion hypotheses, refines the
+  // one with the lowest energy on all levels and returns it if it has a lower
+  // RMSE than firstAttempt, the result of the failed trackFrame call.
+  // Otherwise firstAttempt is returned and its lastRmse is restored.
+  std::pair<SE3, AffineLightTransform<double>> recoverTrack(
+      const PreKeyFrame &frame, const StdVector<SE3> &hypotheses,
+      const AffineLightTransform<double> &coarseAffLight, int minPyrLevel,
+      const std::pair<SE3, AffineLightTransform<double>> &firstAttempt);
+
   void addObserver(FrameTrackerObserver *observer);
 
   // output only
@@ -29,18 +49,50 @@ public:
   double lastRmse;
 
 private:
+  // Depthed points of one base frame pyramid level, stored as parallel arrays
+  struct TrackingPoints {
+    void clear();
+    void push_back(const TrackingPoints &other, int i);
+
+    StdVector<Vec3> positions;
+    StdVector<Vec2> pixels;
+    std::vector<double> intencities;
+    std::vector<double> weights;
+
+    // scratch buffers of trackPyrLevel, not a part of the point set
+    StdVector<Vec3> coarsePositions;
+    StdVector<Vec2> coarseOnImg;
+  };
+
+  TrackingPoints collectPoints(
+      const CameraModel &cam, const cv::Mat1b &baseImg,
+      const std::vector<DepthedImagePyramid::DepthedPixel> &basePixels) const;
+
   std::pair<SE3, AffineLightTransform<double>>
-  trackPyrLevel(const CameraModel &cam, const cv::Mat1b &baseImg,
-                const cv::Mat1d &baseDepths, const cv::Mat1b &trackedImg,
+  trackPyrLevel(const CameraModel &cam, const TrackingPoints &levelPoints,
                 const PreKeyFrameInternals &trackedImgInternals,
                 const SE3 &coarseBaseToTracked,
                 const AffineLightTransform<double> &coarseAffLight,
-                int pyrLevel);
+                int pyrLevel, TrackingPoints &points,
+                StdVector<std::pair<Vec2, double>> *pointResiduals,
+                double *rmse, double *meanEnergy) const;
+
+  void solveCeres(const CameraModel &cam, const TrackingPoints &points,
+                  const PreKeyFrameInternals &trackedImgInternals,
+                  int pyrLevel, SE3 &baseToTracked,
+                  AffineLightTransform<double> &affLight) const;
+  void solveGaussNewton(const CameraModel &cam, const TrackingPoints &points,
+                        const PreKeyFrameInternals &trackedImgInternals,
+                        int pyrLevel, SE3 &baseToTracked,
+                        AffineLightTransform<double> &affLight) const;
 
   const StdVector<CameraModel> &camPyr;
   std::unique_ptr<DepthedImagePyramid> baseFrame;
   int displayWidth, displayHeight;
 
+  std::vector<TrackingPoints> basePoints;
+  TrackingPoints trackablePoints;
+
   std::vector<FrameTrackerObserver *> observers;
   FrameTrackerSettings settings;
 };
@@ -7,6 +7,7 @@
 #include "system/SerializerMode.h"
 #include "util/settings.h"
 #include "util/types.h"
+#include <array>
 
 namespace fishdso {
 
@@ -14,9 +15,14 @@ struct KeyFrame;
 
 template <SerializerMode mode> class PointSerializer;
 
+// Points are stored by value in KeyFrame::immaturePoints, so everything a
+// point needs for tracing lies in one contiguous record. Per-pattern data has
+// a fixed capacity, and the settings are shared with the base keyframe.
 struct ImmaturePoint {
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
+  static constexpr int MPS = Settings::ResidualPattern::max_size;
+
   enum State { ACTIVE, OOB, OUTLIER };
   enum TracingDebugType { NO_DEBUG, DRAW_EPIPOLE };
   enum TracingStatus {
@@ -32,13 +38,48 @@ struct ImmaturePoint {
     LOW_QUALITY
   };
 
+  // Scratch buffers of traceOn. A context is reused across points by one
+  // tracing thread, so that tracing does not allocate once they have grown.
+  struct TracingContext {
+    StdVector<Vec3> coarseDirections;
+    StdVector<Vec2> coarsePoints;
+    StdVector<Vec3> directions;
+    StdVector<Vec2> points;
+    // intencities sampled along the curve, by pattern pixel and then by point
+    std::vector<double> sampledIntencities;
+    std::vector<double> energies;
+    std::vector<double> depths;
+    std::vector<int> pyrLevels;
+    StdVector<std::pair<Vec2, double>> energiesFound;
+  };
+
+  // Reprojects the residual pattern of a point at a given depth into another
+  // frame. Instead of mapping each pattern ray, the offsets of the rays are
+  // mapped with the local affine map d * diffMap at the point.
+  class PatternReprojector {
+  public:
+    PatternReprojector(const CameraModel &cam, const SE3 &baseToRef,
+                       const std::array<Vec3, MPS> &baseDirections,
+                       int patternSize);
+
+    // point is the projection of the pattern center at depth
+    void reproject(const Vec2 &point, double depth,
+                   std::array<Vec2, MPS> &reproj) const;
+
+  private:
+    const CameraModel &cam;
+    Vec3 rotatedBaseDir;
+    Vec3 translation;
+    std::array<Vec3, MPS> rotatedDirOffsets;
+    int patternSize;
+  };
+
   // TODO create PointTracer!!!
-  ImmaturePoint(KeyFrame *baseFrame, const Vec2 &p,
-                const PointTracerSettings &_settings = {});
+  ImmaturePoint(KeyFrame *baseFrame, const Vec2 &p);
   ImmaturePoint(KeyFrame *baseFrame, PointSerializer<LOAD> &pointSerializer);
 
   TracingStatus traceOn(const KeyFrame &baseFrame, const PreKeyFrame &refFrame,
-                        TracingDebugType debugType);
+                        TracingDebugType debugType, TracingContext &context);
 
   static void
   drawTracing(cv::Mat &frame,
@@ -47,11 +88,17 @@ struct ImmaturePoint {
 
   bool isReady(); // checks if the point is good enough to be optimized
 
+  // Lower bound of the disparity stddev that tracing could predict, over all
+  // search directions.
+  double minTracingStddev() const;
+  // false if traceOn is bound to return early without changing the point
+  bool canImprove() const;
+
   Vec2 p;
-  std::vector<Vec3> baseDirections;
-  std::vector<double> baseIntencities;
-  StdVector<Vec2> baseGrad;
-  StdVector<Vec2> baseGradNorm;
+  std::array<Vec3, MPS> baseDirections;
+  std::array<double, MPS> baseIntencities;
+  std::array<Vec2, MPS> baseGrad;
+  std::array<Vec2, MPS> baseGradNorm;
   double minDepth, maxDepth;
   double depth;
   double bestQuality;
@@ -60,7 +107,7 @@ struct ImmaturePoint {
   CameraModel *cam;
   State state;
 
-  PointTracerSettings settings;
+  const PointTracerSettings *settings;
 
   // output only
   bool lastTraced;
@@ -73,13 +120,13 @@ struct ImmaturePoint {
 
 private:
   bool pointsToTrace(const SE3 &baseToRef, Vec3 &dirMinDepth, Vec3 &dirMaxDepth,
-                     StdVector<Vec2> &points, std::vector<Vec3> &directions);
+                     TracingContext &context);
   double estVariance(const Vec2 &searchDirection);
-  Vec2 tracePrecise(
-      const ceres::BiCubicInterpolator<ceres::Grid2D<unsigned char, 1>>
-          &refFrame,
-      const Vec2 &from, const Vec2 &to, const std::vector<double> &intencities,
-      const StdVector<Vec2> &pattern, double &bestDispl, double &bestEnergy);
+  template <typename Interpolator>
+  Vec2 tracePrecise(const Interpolator &refFrame, const Vec2 &from,
+                    const Vec2 &to, const std::array<double, MPS> &intencities,
+                    const std::array<Vec2, MPS> &pattern, double &bestDispl,
+                    double &bestEnergy);
 };
 
 } // namespace fishdso
@@ -45,13 +45,14 @@ struct KeyFrame {
   AffineLightTransform<double> lightWorldToThis;
   SE3 thisToWorld;
 
-  std::vector<std::unique_ptr<ImmaturePoint>> immaturePoints;
+  StdVector<ImmaturePoint> immaturePoints;
   std::vector<std::unique_ptr<OptimizedPoint>> optimizedPoints;
 
   std::vector<std::shared_ptr<PreKeyFrame>> trackedFrames;
 
   Settings::KeyFrame kfSettings;
-  PointTracerSettings tracingSettings;
+  // on the heap, so that the points can refer to it when the keyframe moves
+  std::unique_ptr<const PointTracerSettings> tracingSettings;
 };
 
 } // namespace fishdso
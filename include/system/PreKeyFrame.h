@@ -6,6 +6,7 @@
 #include "util/ImagePyramid.h"
 #include "util/settings.h"
 #include "util/types.h"
+#include <mutex>
 #include <opencv2/core.hpp>
 #include <sophus/se3.hpp>
 
@@ -23,11 +24,16 @@ struct PreKeyFrame {
   ~PreKeyFrame();
 
   cv::Mat frameColored;
-  cv::Mat1d gradX, gradY, gradNorm;
   ImagePyramid framePyr;
   EIGEN_STRONG_INLINE cv::Mat1b &frame() { return framePyr[0]; }
   EIGEN_STRONG_INLINE const cv::Mat1b &frame() const { return framePyr[0]; }
 
+  // Gradients of frame(), computed on the first access from any thread. Most
+  // frames never become keyframes and never need them.
+  const cv::Mat1f &gradX() const;
+  const cv::Mat1f &gradY() const;
+  const cv::Mat1f &gradNorm() const;
+
   KeyFrame *baseKeyFrame;
   CameraModel *cam;
   SE3 baseToThis;
@@ -37,6 +43,12 @@ struct PreKeyFrame {
   Settings::Pyramid pyrSettings;
 
   std::unique_ptr<PreKeyFrameInternals> internals;
+
+private:
+  void computeGradients() const;
+
+  mutable std::once_flag gradientsComputed;
+  mutable cv::Mat1f _gradX, _gradY, _gradNorm;
 };
 
 } // namespace fishdso
@@ -0,0 +1,87 @@
+#ifndef INCLUDE_SLIDINGWINDOWBUNDLEADJUSTER
+#define INCLUDE_SLIDINGWINDOWBUNDLEADJUSTER
+
+#include "system/BundleAdjuster.h"
+#include "system/CameraModel.h"
+#include "system/KeyFrame.h"
+#include <memory>
+
+namespace fishdso {
+
+// Levenberg-Marquardt on the photometric residuals of the keyframe window.
+// Each keyframe has 8 parameters: world translation, left rotation increment
+// and affine light. Point depths are eliminated with the Schur complement.
+// When a keyframe is marginalized, residuals of its points are turned into a
+// Gaussian prior on the remaining keyframes instead of being dropped.
+class SlidingWindowBundleAdjuster : public BundleAdjuster {
+public:
+  static constexpr int frameParams = 8;
+
+  SlidingWindowBundleAdjuster(CameraModel *cam,
+                              const BundleAdjusterSettings &_settings);
+
+  void addKeyFrame(KeyFrame *keyFrame) override;
+  void marginalizeKeyFrame(KeyFrame *keyFrame) override;
+  void adjust(int maxNumIterations) override;
+
+private:
+  // checks the prior and the gauge against dense computations
+  friend class SlidingWindowBundleAdjusterTest;
+
+  struct Point {
+    KeyFrame *baseFrame;
+    OptimizedPoint *optimizedPoint;
+    StdVector<Vec3> directions;
+    std::vector<double> intencities;
+    std::vector<double> weights;
+    std::vector<KeyFrame *> refFrames;
+  };
+
+  struct FrameState {
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+    SE3 thisToWorld;
+    AffineLightTransform<double> lightWorldToThis;
+  };
+
+  // Normal equations over [frames, depths]. The depth-depth block is diagonal,
+  // so only its diagonal Hdd is stored.
+  struct System {
+    MatXX H;
+    VecX b;
+    MatXX Hfd;
+    VecX Hdd;
+    VecX bd;
+  };
+
+  int frameIndex(const KeyFrame *keyFrame) const;
+  void updatePoints();
+  bool isOOB(const KeyFrame &baseFrame, const KeyFrame &refFrame,
+             const OptimizedPoint &optimizedPoint) const;
+
+  // dispatch to the instantiations for the camera type and interpolator
+  double energy() const;
+  void linearize(const std::vector<Point *> &linPoints, System &system) const;
+  template <CameraModel::Type camType, bool bilinear> double energy() const;
+  template <CameraModel::Type camType, bool bilinear>
+  void linearize(const std::vector<Point *> &linPoints, System &system) const;
+
+  double priorEnergy() const;
+  VecX stateDiff() const;
+  MatXX freeParamsBasis() const;
+  void applyStep(const VecX &framesStep, const VecX &depthsStep);
+
+  CameraModel *cam;
+  std::vector<KeyFrame *> keyFrames;
+  std::vector<std::unique_ptr<Point>> points;
+
+  MatXX priorH;
+  VecX priorB;
+  StdVector<FrameState> priorLinearization;
+
+  BundleAdjusterSettings settings;
+};
+
+} // namespace fishdso
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef INCLUDE_UNDISTORTER
+#define INCLUDE_UNDISTORTER
+
+#include "system/CameraModel.h"
+#include <opencv2/core.hpp>
+
+namespace fishdso {
+
+// Undistorts images of one camera into a pinhole image with the given camera
+// matrix. The fixed-point cv::remap maps are computed once on construction, so
+// each undistort call is a single bilinear remap, parallelized by OpenCV.
+class Undistorter {
+public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+  // the undistorted image has the size of the camera image by default
+  Undistorter(const CameraModel &cam, const Mat33 &cameraMatrix);
+  Undistorter(const CameraModel &cam, const Mat33 &cameraMatrix, int width,
+              int height);
+
+  cv::Mat undistort(const cv::Mat &img) const;
+  void undistort(const cv::Mat &img, cv::Mat &result) const;
+
+private:
+  cv::Mat map1, map2;
+};
+
+} // namespace fishdso
+
+#endif
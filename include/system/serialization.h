@@ -131,6 +131,10 @@ private:
   void loadPointVector(DataSerializer<LOAD> &ownData, KeyFrame &baseFrame,
                        std::vector<std::unique_ptr<PointT>> &pointVector,
                        PointSerializer<LOAD> &pointSerializer) const;
+  template <typename PointT>
+  void loadPointVector(DataSerializer<LOAD> &ownData, KeyFrame &baseFrame,
+                       StdVector<PointT> &pointVector,
+                       PointSerializer<LOAD> &pointSerializer) const;
   void loadTrackedVector(DataSerializer<LOAD> &ownData,
                          KeyFrame &keyFrame) const;
 
@@ -151,6 +155,10 @@ private:
   void storePointVector(DataSerializer<STORE> &ownData,
                         const std::vector<std::unique_ptr<PointT>> &pointVector,
                         PointSerializer<STORE> &pointSerializer) const;
+  template <typename PointT>
+  void storePointVector(DataSerializer<STORE> &ownData,
+                        const StdVector<PointT> &pointVector,
+                        PointSerializer<STORE> &pointSerializer) const;
   void storeTrackedVector(DataSerializer<STORE> &ownData,
                           const KeyFrame &keyFrame) const;
 
@@ -8,12 +8,24 @@
 namespace fishdso {
 
 struct DepthedImagePyramid : ImagePyramid {
+  struct DepthedPixel {
+    cv::Point pixel;
+    double depth;
+  };
+
   DepthedImagePyramid(const cv::Mat1b &baseImage, int levelNum,
                       const StdVector<Vec2> &points,
                       const std::vector<double> &depthsVec,
                       const std::vector<double> &weightsVec);
+  // Reuses the images of an already built pyramid, only depths are computed.
+  DepthedImagePyramid(const ImagePyramid &imagePyr, int levelNum,
+                      const StdVector<Vec2> &points,
+                      const std::vector<double> &depthsVec,
+                      const std::vector<double> &weightsVec);
 
-  std::vector<cv::Mat1d> depths;
+  // Pixels with known depth on each level, in row-major order. The depth of a
+  // pixel is the weighted mean depth of all the points that fall into it.
+  std::vector<std::vector<DepthedPixel>> depthedPixels;
 };
 
 } // namespace fishdso
@@ -7,13 +7,28 @@
 
 namespace fishdso {
 
+// Each level is stored with a border of replicated pixels, which lets the
+// interpolators read around the image without clamping every access. The
+// levels themselves are views into this storage.
 struct ImagePyramid {
+  static constexpr int border = 3;
+
   ImagePyramid(const cv::Mat1b &baseImage, int levelNum);
+  // Converts a BGR image to gray directly into the storage of the base level.
+  ImagePyramid(const cv::Mat3b &coloredImage, int levelNum);
+  // Shares the images of other without copying them. Levels missing in other
+  // are computed.
+  ImagePyramid(const ImagePyramid &other, int levelNum);
 
   inline cv::Mat1b &operator[](int ind) { return images[ind]; }
   inline const cv::Mat1b &operator[](int ind) const { return images[ind]; }
 
   std::vector<cv::Mat1b> images;
+  std::vector<cv::Mat1b> paddedImages;
+
+private:
+  void createLevel(int lvl, int rows, int cols);
+  void buildLevels(int fromLvl);
 };
 
 } // namespace fishdso
@@ -11,12 +11,12 @@ class PixelSelector {
 public:
   PixelSelector(const Settings::PixelSelector &settings = {});
 
-  std::vector<cv::Point> select(const cv::Mat &frame, const cv::Mat1d &gradNorm,
+  std::vector<cv::Point> select(const cv::Mat &frame, const cv::Mat1f &gradNorm,
                                 int pointsNeeded, cv::Mat *debugOut);
 
 private:
   std::vector<cv::Point> selectInternal(const cv::Mat &frame,
-                                        const cv::Mat1d &gradNorm,
+                                        const cv::Mat1f &gradNorm,
                                         int pointsNeeded, int blockSize,
                                         cv::Mat *debugOut);
 
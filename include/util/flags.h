@@ -18,6 +18,8 @@ DECLARE_bool(optimize_affine_light);
 DECLARE_bool(perform_full_tracing);
 DECLARE_bool(use_alt_H_weighting);
 DECLARE_int32(tracing_GN_iter);
+DECLARE_bool(bilinear_tracing);
+DECLARE_int32(max_traced_points);
 
 DECLARE_double(pos_variance);
 
@@ -29,15 +31,22 @@ DECLARE_bool(track_from_lask_kf);
 DECLARE_bool(predict_using_screw);
 DECLARE_bool(use_grad_weights_on_tracking);
 DECLARE_double(track_fail_factor);
+DECLARE_bool(use_ceres_tracking);
+DECLARE_int32(tracking_max_iter);
+DECLARE_bool(bilinear_tracking);
 
 DECLARE_bool(gt_poses);
 
 DECLARE_bool(run_ba);
+DECLARE_bool(use_ceres_ba);
+DECLARE_bool(bilinear_ba);
 DECLARE_bool(fixed_motion_on_first_ba);
 DECLARE_double(optimized_stddev);
 
 DECLARE_int32(shift_between_keyframes);
+DECLARE_bool(background_mapping);
 DECLARE_bool(deterministic);
+DECLARE_string(camera_cache_dir);
 
 namespace fishdso {
 
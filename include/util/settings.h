@@ -18,11 +18,19 @@ struct BundleAdjusterSettings;
 
 struct Settings {
   struct CameraModel {
+    static constexpr int max_mapPolyDegree = 15;
     static constexpr int default_mapPolyDegree = 10;
     int mapPolyDegree = default_mapPolyDegree;
 
     static constexpr int default_mapPolyPoints = 2000;
     int mapPolyPoints = default_mapPolyPoints;
+
+    static constexpr bool default_useRayTable = true;
+    bool useRayTable = default_useRayTable;
+
+    // fitted calibration and ray tables are cached here, empty disables it
+    static const std::string default_cacheDirectory;
+    std::string cacheDirectory = default_cacheDirectory;
   } cameraModel;
 
   struct PixelSelector {
@@ -143,6 +151,13 @@ struct Settings {
 
     static constexpr bool default_useAltHWeighting = true;
     bool useAltHWeighting = default_useAltHWeighting;
+
+    static constexpr bool default_useBilinear = false;
+    bool useBilinear = default_useBilinear;
+
+    // at most this many points are traced on each frame, 0 means no limit
+    static constexpr int default_maxTracedPoints = 0;
+    int maxTracedPoints = default_maxTracedPoints;
   } pointTracer;
 
   struct FrameTracker {
@@ -151,6 +166,27 @@ struct Settings {
 
     static constexpr bool default_useGradWeighting = false;
     bool useGradWeighting = default_useGradWeighting;
+
+    static constexpr bool default_useCeres = false;
+    bool useCeres = default_useCeres;
+
+    static constexpr int default_maxIterations = 20;
+    int maxIterations = default_maxIterations;
+
+    static constexpr double default_initialLambda = 1e-5;
+    double initialLambda = default_initialLambda;
+
+    static constexpr double default_minStepNorm = 1e-6;
+    double minStepNorm = default_minStepNorm;
+
+    static constexpr int default_recoveryMinPyrLevel = 2;
+    int recoveryMinPyrLevel = default_recoveryMinPyrLevel;
+
+    static constexpr double default_recoveryRotationAngle = 0.02;
+    double recoveryRotationAngle = default_recoveryRotationAngle;
+
+    static constexpr bool default_useBilinear = false;
+    bool useBilinear = default_useBilinear;
   } frameTracker;
 
   struct BundleAdjuster {
@@ -165,6 +201,18 @@ struct Settings {
 
     static constexpr bool default_runBA = true;
     bool runBA = default_runBA;
+
+    static constexpr bool default_useCeres = true;
+    bool useCeres = default_useCeres;
+
+    static constexpr double default_initialLambda = 1e-4;
+    double initialLambda = default_initialLambda;
+
+    static constexpr double default_minStepNorm = 1e-6;
+    double minStepNorm = default_minStepNorm;
+
+    static constexpr bool default_useBilinear = false;
+    bool useBilinear = default_useBilinear;
   } bundleAdjuster;
 
   struct Pyramid {
@@ -204,16 +252,11 @@ struct Settings {
   } gradWeighting;
 
   struct ResidualPattern {
-    ResidualPattern(const StdVector<Vec2> &newPattern = default_pattern)
-        : _pattern(newPattern) {
-      height =
-          int(std::ceil(std::max_element(_pattern.begin(), _pattern.end(),
-                                         [](const Vec2 &a, const Vec2 &b) {
-                                           return a.lpNorm<Eigen::Infinity>() <
-                                                  b.lpNorm<Eigen::Infinity>();
-                                         })
-                            ->lpNorm<Eigen::Infinity>()));
-    }
+    // Points store their pattern in arrays of this capacity, so a pattern
+    // with more pixels is rejected on construction.
+    static constexpr int max_size = 9;
+
+    ResidualPattern(const StdVector<Vec2> &newPattern = default_pattern);
 
     inline const StdVector<Vec2> &pattern() const { return _pattern; }
     int height;
@@ -248,6 +291,9 @@ struct Settings {
   static constexpr bool default_continueChoosingKeyFrames = true;
   bool continueChoosingKeyFrames = default_continueChoosingKeyFrames;
 
+  static constexpr bool default_backgroundMapping = false;
+  bool backgroundMapping = default_backgroundMapping;
+
   static constexpr int default_initialMaxFrame = 2500;
   int initialMaxFrame = default_initialMaxFrame;
 
@@ -60,8 +60,8 @@ void putCross(cv::Mat &img, const cv::Point &pos, int size,
 void putSquare(cv::Mat &img, const cv::Point &pos, int size,
                const cv::Scalar &col, int thickness);
 
-void grad(const cv::Mat &img, cv::Mat1d &gradX, cv::Mat1d &gradY,
-          cv::Mat1d &gradNorm);
+void grad(const cv::Mat1b &img, cv::Mat1f &gradX, cv::Mat1f &gradY,
+          cv::Mat1f &gradNorm);
 double gradNormAt(const cv::Mat1b &img, const cv::Point &p);
 
 cv::Scalar depthCol(double d, double mind, double maxd);
@@ -86,28 +86,48 @@ template <> struct accum_type<cv::Vec3b> { typedef cv::Vec3i type; };
 template <typename T> cv::Mat boxFilterPyrDown(const cv::Mat &img) {
   constexpr int d = 2;
   cv::Mat result(img.rows / d, img.cols / d, img.type());
-  for (int y = 0; y < img.rows / d * d; y += d)
-    for (int x = 0; x < img.cols / d * d; x += d) {
+  for (int y = 0; y < result.rows; ++y) {
+    const T *row0 = img.ptr<T>(d * y);
+    const T *row1 = img.ptr<T>(d * y + 1);
+    T *dst = result.ptr<T>(y);
+    for (int x = 0; x < result.cols; ++x) {
       typename accum_type<T>::type accum = typename accum_type<T>::type();
-      for (int yy = 0; yy < d; ++yy)
-        for (int xx = 0; xx < d; ++xx)
-          accum += img.at<T>(y + yy, x + xx);
-      result.at<T>(y / d, x / d) = T(accum / (d * d));
+      for (int xx = 0; xx < d; ++xx) {
+        accum += row0[d * x + xx];
+        accum += row1[d * x + xx];
+      }
+      dst[x] = T(accum / (d * d));
     }
+  }
 
   return result;
 }
 
-extern template cv::Mat boxFilterPyrDown<unsigned char>(const cv::Mat &img);
+// Averages 2x2 blocks of two adjacent source rows into dstWidth pixels,
+// truncating like the generic boxFilterPyrDown. Vectorized where possible.
+void boxFilterPyrDownRow(const unsigned char *row0, const unsigned char *row1,
+                         unsigned char *dst, int dstWidth);
+
+template <> cv::Mat boxFilterPyrDown<unsigned char>(const cv::Mat &img);
 extern template cv::Mat boxFilterPyrDown<cv::Vec3b>(const cv::Mat &img);
 
+// Huber energy of a residual pattern: the sum over pattern pixels of r^2 if
+// |r| <= outlierDiff and outlierDiff * (2|r| - outlierDiff) otherwise, where r
+// is the difference between intencities[i] and sampled[i].
+double patternEnergy(const double *intencities, const double *sampled,
+                     int patternSize, double outlierDiff);
+
+// patternEnergy at numPositions positions at once, vectorized over positions.
+// sampled[i * numPositions + k] is the i-th pattern pixel at k-th position.
+// The results are bitwise equal to those of patternEnergy.
+void patternEnergies(const double *intencities, const double *sampled,
+                     int patternSize, int numPositions, double outlierDiff,
+                     double *energies);
+
 cv::Mat1b cvtBgrToGray(const cv::Mat &coloredImg);
 cv::Mat3b cvtBgrToGray3(const cv::Mat3b coloredImg);
 cv::Mat3b cvtGrayToBgr(const cv::Mat1b &grayImg);
 
-cv::Mat1d pyrNUpDepth(const cv::Mat1d &integralWeightedDepths,
-                      const cv::Mat1d &integralWeights, int levelNum);
-
 cv::Mat3b drawDepthedFrame(const cv::Mat1b &frame, const cv::Mat1d &depths,
                            double minDepth, double maxDepth);
 
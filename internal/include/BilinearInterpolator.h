@@ -0,0 +1,53 @@
+#ifndef INCLUDE_BILINEARINTERPOLATOR
+#define INCLUDE_BILINEARINTERPOLATOR
+
+#include "util/types.h"
+#include <algorithm>
+#include <opencv2/core.hpp>
+
+namespace fishdso {
+
+// A faster alternative to ceres::BiCubicInterpolator with the same Evaluate
+// interface. Each pixel stores [I, dI/dx, dI/dy, 0] as floats, so one lookup
+// blends four pixels with packet arithmetic. Gradients are precomputed with
+// central differences and interpolated too, thus they are smooth but not
+// the exact derivatives of the interpolated intensity. The image is padded
+// with a replicated border, lookups further out are clamped to it.
+class BilinearInterpolator {
+public:
+  static constexpr int padding = 2;
+
+  BilinearInterpolator(const cv::Mat1b &image);
+
+  EIGEN_STRONG_INLINE void Evaluate(double r, double c, double *f) const {
+    *f = sample(r, c)[0];
+  }
+
+  EIGEN_STRONG_INLINE void Evaluate(double r, double c, double *f,
+                                    double *dfdr, double *dfdc) const {
+    Vec4f s = sample(r, c);
+    *f = s[0];
+    *dfdc = s[1];
+    *dfdr = s[2];
+  }
+
+private:
+  EIGEN_STRONG_INLINE Vec4f sample(double r, double c) const {
+    float x = std::clamp(float(c), -float(padding), maxX);
+    float y = std::clamp(float(r), -float(padding), maxY);
+    // coordinates are nonnegative after the shift, so truncation is floor
+    int x0 = int(x + padding), y0 = int(y + padding);
+    float dx = x + padding - x0, dy = y + padding - y0;
+    const Vec4f *p = &data[y0 * stride + x0];
+    return (1 - dy) * ((1 - dx) * p[0] + dx * p[1]) +
+           dy * ((1 - dx) * p[stride] + dx * p[stride + 1]);
+  }
+
+  int stride;
+  float maxX, maxY;
+  StdVector<Vec4f> data;
+};
+
+} // namespace fishdso
+
+#endif
@@ -0,0 +1,181 @@
+#ifndef INCLUDE_DIRECTRESIDUAL
+#define INCLUDE_DIRECTRESIDUAL
+
+#include "PreKeyFrameInternals.h"
+#include "system/CameraModel.h"
+#include "system/KeyFrame.h"
+#include "system/OptimizedPoint.h"
+#include "util/types.h"
+#include <ceres/cost_function.h>
+#include <cmath>
+
+namespace fishdso {
+
+// Derivative of the rotation of v by the unit quaternion q w.r.t. the
+// quaternion coefficients, stored as (x, y, z, w) like in Eigen and Sophus.
+inline Mat34 rotationJacobian(const Quaternion &q, const Vec3 &v) {
+  Vec3 u = q.vec();
+  Mat34 result;
+  result.leftCols<3>() =
+      -2 * q.w() * SO3::hat(v) +
+      2 * (u * v.transpose() + u.dot(v) * Mat33::Identity() -
+           2 * v * u.transpose());
+  result.col(3) = 2 * u.cross(v);
+  return result;
+}
+
+// Photometric residuals of all residual pattern pixels of one point observed
+// in one reference keyframe. The relative pose and the affine light transform
+// are computed once per block and the Jacobians are analytic. The Huber loss
+// and the gradient-dependent weights are folded into the residuals, so that
+// the squared norm of the block is the robust energy of its pixels.
+class DirectResidual : public ceres::CostFunction {
+  typedef Eigen::Matrix<double, 1, 3> RowVec3;
+  typedef Eigen::Matrix<double, 1, 4> RowVec4;
+
+public:
+  DirectResidual(const PreKeyFrameInternals::Interpolator_t *baseFrame,
+                 const PreKeyFrameInternals::Interpolator_t *refFrame,
+                 const CameraModel *cam, const OptimizedPoint *optimizedPoint,
+                 const StdVector<Vec2> &pattern,
+                 const std::vector<double> &weights, double outlierDiff,
+                 KeyFrame *baseKf, KeyFrame *refKf)
+      : baseKf(baseKf)
+      , refKf(refKf)
+      , cam(cam)
+      , refFrame(refFrame)
+      , weights(weights)
+      , outlierDiff(outlierDiff) {
+    baseDirections.reserve(pattern.size());
+    baseIntencities.resize(pattern.size());
+    for (int i = 0; i < pattern.size(); ++i) {
+      Vec2 pos = optimizedPoint->p + pattern[i];
+      baseDirections.push_back(cam->unmapUnit(pos));
+      baseFrame->Evaluate(pos[1], pos[0], &baseIntencities[i]);
+    }
+
+    set_num_residuals(pattern.size());
+    mutable_parameter_block_sizes()->assign({1, 3, 4, 3, 4, 2, 2});
+  }
+
+  bool Evaluate(double const *const *parameters, double *residuals,
+                double **jacobians) const override {
+    evaluate(parameters, residuals, jacobians, true);
+    return true;
+  }
+
+  // raw photometric residuals at the current state of the keyframes
+  std::vector<double> values(double logInvDepth) const {
+    const double *parameters[] = {&logInvDepth,
+                                  baseKf->thisToWorld.translation().data(),
+                                  baseKf->thisToWorld.so3().data(),
+                                  refKf->thisToWorld.translation().data(),
+                                  refKf->thisToWorld.so3().data(),
+                                  baseKf->lightWorldToThis.data,
+                                  refKf->lightWorldToThis.data};
+    std::vector<double> result(num_residuals());
+    evaluate(parameters, result.data(), nullptr, false);
+    return result;
+  }
+
+  KeyFrame *baseKf;
+  KeyFrame *refKf;
+
+private:
+  void evaluate(double const *const *parameters, double *residuals,
+                double **jacobians, bool robust) const {
+    double logInvDepth = parameters[0][0];
+    Eigen::Map<const Vec3> baseTrans(parameters[1]);
+    Eigen::Map<const Quaternion> baseRot(parameters[2]);
+    Eigen::Map<const Vec3> refTrans(parameters[3]);
+    Eigen::Map<const Quaternion> refRot(parameters[4]);
+    const double *baseAff = parameters[5];
+    const double *refAff = parameters[6];
+
+    Mat33 worldToRef = refRot.toRotationMatrix().transpose();
+    Mat33 baseToRef = worldToRef * baseRot.toRotationMatrix();
+    Vec3 baseToRefTrans = worldToRef * (baseTrans - refTrans);
+    double depth = std::exp(-logInvDepth);
+    double lightRel = std::exp(baseAff[0] - refAff[0]);
+    Quaternion refRotInv = refRot.conjugate();
+
+    for (int i = 0; i < baseDirections.size(); ++i) {
+      Vec3 inBase = baseDirections[i] * depth;
+      Vec3 inRef = baseToRef * inBase + baseToRefTrans;
+      double baseTransformed = lightRel * (baseIntencities[i] + baseAff[1]);
+
+      double res, robustDeriv;
+      if (!jacobians) {
+        double refIntencity;
+        Vec2 onRef = cam->map(inRef);
+        refFrame->Evaluate(onRef[1], onRef[0], &refIntencity);
+        res = refIntencity + refAff[1] - baseTransformed;
+        residuals[i] = robustify(res, weights[i], robust, &robustDeriv);
+        continue;
+      }
+
+      double refIntencity, dIdy, dIdx;
+      auto [onRef, mapJacobian] = cam->diffMap(inRef);
+      refFrame->Evaluate(onRef[1], onRef[0], &refIntencity, &dIdy, &dIdx);
+      res = refIntencity + refAff[1] - baseTransformed;
+      residuals[i] = robustify(res, weights[i], robust, &robustDeriv);
+
+      // derivative of the residual w.r.t. the point in ref
+      RowVec3 dInRef = robustDeriv * Vec2(dIdx, dIdy).transpose() * mapJacobian;
+      RowVec3 dInWorld = dInRef * worldToRef;
+      if (jacobians[0])
+        jacobians[0][i] = -dInRef.dot(baseToRef * inBase);
+      if (jacobians[1])
+        Eigen::Map<RowVec3>(jacobians[1] + 3 * i) = dInWorld;
+      if (jacobians[2])
+        Eigen::Map<RowVec4>(jacobians[2] + 4 * i) =
+            dInWorld * rotationJacobian(baseRot, inBase);
+      if (jacobians[3])
+        Eigen::Map<RowVec3>(jacobians[3] + 3 * i) = -dInWorld;
+      if (jacobians[4]) {
+        Vec3 inWorldRel = baseRot * inBase + baseTrans - refTrans;
+        Mat34 dRot = rotationJacobian(refRotInv, inWorldRel);
+        dRot.leftCols<3>() *= -1;
+        Eigen::Map<RowVec4>(jacobians[4] + 4 * i) = dInRef * dRot;
+      }
+      if (jacobians[5]) {
+        jacobians[5][2 * i] = -robustDeriv * baseTransformed;
+        jacobians[5][2 * i + 1] = -robustDeriv * lightRel;
+      }
+      if (jacobians[6]) {
+        jacobians[6][2 * i] = robustDeriv * baseTransformed;
+        jacobians[6][2 * i + 1] = robustDeriv;
+      }
+    }
+  }
+
+  // Turns res into a residual whose half-square is the weighted Huber energy
+  // of res and computes the derivative of the new residual w.r.t. res.
+  double robustify(double res, double weight, bool robust,
+                   double *deriv) const {
+    if (!robust) {
+      *deriv = 1;
+      return res;
+    }
+    double absRes = std::abs(res);
+    if (absRes <= outlierDiff) {
+      *deriv = std::sqrt(weight);
+      return *deriv * res;
+    }
+    double robustRes =
+        std::sqrt(2 * weight * outlierDiff * (absRes - 0.5 * outlierDiff));
+    *deriv = weight * outlierDiff / robustRes;
+    return res > 0 ? robustRes : -robustRes;
+  }
+
+  const CameraModel *cam;
+  const PreKeyFrameInternals::Interpolator_t *refFrame;
+  StdVector<Vec3> baseDirections;
+  std::vector<double> baseIntencities;
+  std::vector<double> weights;
+  double outlierDiff;
+};
+
+} // namespace fishdso
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef INCLUDE_PADDEDINTERPOLATOR
+#define INCLUDE_PADDEDINTERPOLATOR
+
+#include <algorithm>
+#include <ceres/cubic_interpolation.h>
+#include <glog/logging.h>
+#include <opencv2/core.hpp>
+
+namespace fishdso {
+
+// Grid over an image stored with a border of replicated pixels. Unlike
+// ceres::Grid2D, rows and columns are not clamped, so every access has to
+// stay inside the border.
+struct PaddedGrid {
+  enum { DATA_DIMENSION = 1 };
+
+  PaddedGrid(const cv::Mat1b &padded, int border)
+      : origin(padded[border] + border)
+      , stride(int(padded.step1())) {}
+
+  EIGEN_STRONG_INLINE void GetValue(int r, int c, double *f) const {
+    *f = origin[r * stride + c];
+  }
+
+  const unsigned char *origin;
+  int stride;
+};
+
+// Bicubic interpolation over a PaddedGrid. The sample position is clamped
+// once, to where the whole stencil lies inside the border, instead of
+// clamping each of the 16 accesses. With a border of at least minBorder this
+// gives exactly the values of ceres::BiCubicInterpolator over a clamped grid.
+class PaddedInterpolator {
+public:
+  // the stencil reaches 1 pixel before the sample and 2 after it, plus one
+  // pixel for the clamped stencil to lie fully outside the image
+  static constexpr int minBorder = 3;
+
+  PaddedInterpolator(const cv::Mat1b &padded, int border, int rows, int cols)
+      : grid(padded, border)
+      , interpolator(grid)
+      , minCoord(1 - border)
+      , maxRow(rows - 3 + border)
+      , maxCol(cols - 3 + border) {
+    CHECK_GE(border, minBorder);
+  }
+
+  PaddedInterpolator(const PaddedInterpolator &) = delete;
+  PaddedInterpolator &operator=(const PaddedInterpolator &) = delete;
+
+  EIGEN_STRONG_INLINE void Evaluate(double r, double c, double *f) const {
+    interpolator.Evaluate(std::clamp(r, minCoord, maxRow),
+                          std::clamp(c, minCoord, maxCol), f);
+  }
+
+  EIGEN_STRONG_INLINE void Evaluate(double r, double c, double *f,
+                                    double *dfdr, double *dfdc) const {
+    interpolator.Evaluate(std::clamp(r, minCoord, maxRow),
+                          std::clamp(c, minCoord, maxCol), f, dfdr, dfdc);
+  }
+
+private:
+  PaddedGrid grid;
+  ceres::BiCubicInterpolator<PaddedGrid> interpolator;
+  double minCoord, maxRow, maxCol;
+};
+
+} // namespace fishdso
+
+#endif
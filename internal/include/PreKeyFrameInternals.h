@@ -1,8 +1,12 @@
 #ifndef INCLUDE_PREKEYFRAMEINTERNALS
 #define INCLUDE_PREKEYFRAMEINTERNALS
 
+#include "BilinearInterpolator.h"
+#include "PaddedInterpolator.h"
 #include "util/ImagePyramid.h"
 #include <ceres/cubic_interpolation.h>
+#include <memory>
+#include <mutex>
 
 namespace fishdso {
 
@@ -11,13 +15,32 @@ public:
   using Grid_t = ceres::Grid2D<unsigned char>;
   using Interpolator_t = ceres::BiCubicInterpolator<Grid_t>;
 
+  // The grids and interpolators read the padded storage of the pyramid
+  // levels, whose border is wide enough for the bicubic stencil of
+  // PaddedInterpolator. Pattern pixels need no extra border, as
+  // PaddedInterpolator clamps the sample positions.
   PreKeyFrameInternals(const ImagePyramid &pyramid,
                        const Settings::Pyramid &_pyrSettings);
 
   Grid_t &grid(int lvl);
   const Grid_t &grid(int lvl) const;
+  // Clamps every grid access, can be evaluated on Jets.
   Interpolator_t &interpolator(int lvl);
   const Interpolator_t &interpolator(int lvl) const;
+  // Same values as interpolator(), but the stencil is read from the border
+  // without clamping. Used in the hand-written hot loops.
+  const PaddedInterpolator &paddedInterpolator(int lvl) const;
+
+  // Built on the first access, as most frames are only ever sampled with one
+  // of the two interpolators.
+  const BilinearInterpolator &bilinear(int lvl) const;
+
+  // Calls func with the bilinear or the bicubic interpolator of the level, so
+  // that callers can be instantiated for both.
+  template <typename Func>
+  auto withInterpolator(int lvl, bool useBilinear, Func func) const {
+    return useBilinear ? func(bilinear(lvl)) : func(paddedInterpolator(lvl));
+  }
 
 private:
   alignas(alignof(Grid_t))
@@ -26,6 +49,17 @@ private:
       interpolatorsData[Settings::Pyramid::max_levelNum *
                         sizeof(Interpolator_t)];
   Settings::Pyramid pyrSettings;
+  static constexpr int border = ImagePyramid::border;
+  static_assert(border >= PaddedInterpolator::minBorder,
+                "pyramid border is too narrow for the bicubic stencil");
+
+  std::vector<cv::Mat1b> images;
+  std::vector<cv::Mat1b> paddedImages;
+  std::unique_ptr<PaddedInterpolator>
+      paddedInterpolators[Settings::Pyramid::max_levelNum];
+  mutable std::once_flag bilinearsBuilt[Settings::Pyramid::max_levelNum];
+  mutable std::unique_ptr<BilinearInterpolator>
+      bilinears[Settings::Pyramid::max_levelNum];
 };
 
 } // namespace fishdso
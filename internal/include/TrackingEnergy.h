@@ -0,0 +1,111 @@
+#ifndef INCLUDE_TRACKINGENERGY
+#define INCLUDE_TRACKINGENERGY
+
+#include "system/AffineLightTransform.h"
+#include "system/CameraModel.h"
+#include "util/types.h"
+#include <cmath>
+
+namespace fishdso {
+
+// Photometric residual lightMult * (I + lightAdd) - baseIntencity of a base
+// point at pos (in the base frame), where I is sampled on the tracked frame
+// under the motion [rot | trans] and lightMult = exp(affA), lightAdd = affB.
+// Returns false if the point is projected out of the image. If J is not null,
+// it is set to the derivative of the residual over [translation, rotation,
+// affA, affB], with the motion increment applied from the left:
+// baseToTracked <- exp(delta) * baseToTracked.
+template <CameraModel::Type camType, typename Interpolator>
+EIGEN_STRONG_INLINE bool
+trackingResidual(const CameraModel &cam, const Interpolator &tracked,
+                 const Mat33 &rot, const Vec3 &trans, double lightMult,
+                 double lightAdd, const Vec3 &basePos, double baseIntencity,
+                 double *res, Vec8 *J) {
+  Vec3 pos = rot * basePos + trans;
+  Vec2 onTracked;
+  Mat23 mapJacobian;
+  if (J)
+    std::tie(onTracked, mapJacobian) = cam.diffMapAs<camType>(pos);
+  else
+    onTracked = cam.mapAs<camType>(pos);
+
+  if (!cam.isOnImage(onTracked, 0))
+    return false;
+
+  double trackedIntencity, dIdy, dIdx;
+  tracked.Evaluate(onTracked[1], onTracked[0], &trackedIntencity, &dIdy,
+                   &dIdx);
+  *res = lightMult * (trackedIntencity + lightAdd) - baseIntencity;
+
+  if (J) {
+    Vec3 dIdPos = lightMult * mapJacobian.transpose() * Vec2(dIdx, dIdy);
+    J->head<3>() = dIdPos;
+    J->segment<3>(3) = pos.cross(dIdPos);
+    (*J)[6] = lightMult * (trackedIntencity + lightAdd);
+    (*J)[7] = lightMult;
+  }
+
+  return true;
+}
+
+// Computes the robustified tracking energy for the given motion and affine
+// light transform. If H and b are not null, also accumulates the normal
+// equations H * delta = -b over [translation, rotation, affA, affB], see
+// trackingResidual. Instantiated for each camera type and interpolator, so
+// the projection and the sampling are inlined into the loop.
+template <CameraModel::Type camType, typename Interpolator>
+double accumulateTracking(const CameraModel &cam, const Interpolator &tracked,
+                          const StdVector<Vec3> &positions,
+                          const std::vector<double> &intencities,
+                          const std::vector<double> &weights,
+                          const SE3 &baseToTracked,
+                          const AffineLightTransform<double> &affLight,
+                          double outlierDiff, Mat88 *H, Vec8 *b) {
+  if (H) {
+    H->setZero();
+    b->setZero();
+  }
+
+  const Mat33 rot = baseToTracked.rotationMatrix();
+  const Vec3 trans = baseToTracked.translation();
+  const double lightMult = std::exp(affLight.data[0]);
+  const double lightAdd = affLight.data[1];
+  const double outlierEnergy = 0.5 * outlierDiff * outlierDiff;
+
+  double energy = 0;
+  Vec8 J;
+  for (int i = 0; i < positions.size(); ++i) {
+    double res;
+    if (!trackingResidual<camType>(cam, tracked, rot, trans, lightMult,
+                                   lightAdd, positions[i], intencities[i],
+                                   &res, H ? &J : nullptr)) {
+      energy += weights[i] * outlierEnergy;
+      continue;
+    }
+    double absRes = std::abs(res);
+
+    double hubWeight = 1.0;
+    if (absRes <= outlierDiff)
+      energy += weights[i] * 0.5 * res * res;
+    else {
+      energy += weights[i] * outlierDiff * (absRes - 0.5 * outlierDiff);
+      hubWeight = outlierDiff / absRes;
+    }
+
+    if (!H)
+      continue;
+
+    double w = weights[i] * hubWeight;
+    H->selfadjointView<Eigen::Upper>().rankUpdate(J, w);
+    *b += w * res * J;
+  }
+
+  if (H)
+    *H = H->selfadjointView<Eigen::Upper>();
+
+  return energy;
+}
+
+} // namespace fishdso
+
+#endif
@@ -0,0 +1,28 @@
+#include "BilinearInterpolator.h"
+
+namespace fishdso {
+
+BilinearInterpolator::BilinearInterpolator(const cv::Mat1b &image)
+    : stride(image.cols + 2 * padding + 1)
+    , maxX(image.cols - 1 + padding)
+    , maxY(image.rows - 1 + padding)
+    , data(stride * (image.rows + 2 * padding + 1)) {
+  const int w = image.cols, h = image.rows;
+  // one extra row and column past the padding, as a sample at the far edge
+  // still reads its right and bottom neighbours
+  for (int py = 0; py < h + 2 * padding + 1; ++py) {
+    int y = std::clamp(py - padding, 0, h - 1);
+    const unsigned char *row = image[y];
+    const unsigned char *up = image[std::max(y - 1, 0)];
+    const unsigned char *down = image[std::min(y + 1, h - 1)];
+    for (int px = 0; px < stride; ++px) {
+      int x = std::clamp(px - padding, 0, w - 1);
+      data[py * stride + px] =
+          Vec4f(float(row[x]), 0.5f * (float(row[std::min(x + 1, w - 1)]) -
+                                float(row[std::max(x - 1, 0)])),
+                0.5f * (float(down[x]) - float(up[x])), 0.0f);
+    }
+  }
+}
+
+} // namespace fishdso
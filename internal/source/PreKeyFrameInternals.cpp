@@ -4,12 +4,24 @@ namespace fishdso {
 
 PreKeyFrameInternals::PreKeyFrameInternals(
     const ImagePyramid &pyramid, const Settings::Pyramid &_pyrSettings)
-    : pyrSettings(_pyrSettings) {
+    : pyrSettings(_pyrSettings)
+    , images(pyramid.images.begin(),
+             pyramid.images.begin() + _pyrSettings.levelNum)
+    , paddedImages(pyramid.paddedImages.begin(),
+                   pyramid.paddedImages.begin() + _pyrSettings.levelNum) {
   for (int lvl = 0; lvl < pyrSettings.levelNum; ++lvl) {
+    const int rows = pyramid[lvl].rows, cols = pyramid[lvl].cols;
+    CHECK(paddedImages[lvl].isContinuous());
+
+    // the clamping grid covers the border too, which does not change the
+    // values as the border replicates the edge pixels
     Grid_t *newGrid = new (&gridsData[lvl * sizeof(Grid_t)])
-        Grid_t(pyramid[lvl].data, 0, pyramid[lvl].rows, 0, pyramid[lvl].cols);
+        Grid_t(paddedImages[lvl].data, -border, rows + border, -border,
+               cols + border);
     new (&interpolatorsData[lvl * sizeof(Interpolator_t)])
         Interpolator_t(*newGrid);
+    paddedInterpolators[lvl].reset(
+        new PaddedInterpolator(paddedImages[lvl], border, rows, cols));
   }
 }
 
@@ -37,4 +49,18 @@ PreKeyFrameInternals::interpolator(int lvl) const {
       &interpolatorsData[lvl * sizeof(Interpolator_t)]);
 }
 
+const PaddedInterpolator &
+PreKeyFrameInternals::paddedInterpolator(int lvl) const {
+  CHECK(lvl >= 0 && lvl < pyrSettings.levelNum);
+  return *paddedInterpolators[lvl];
+}
+
+const BilinearInterpolator &PreKeyFrameInternals::bilinear(int lvl) const {
+  CHECK(lvl >= 0 && lvl < pyrSettings.levelNum);
+  std::call_once(bilinearsBuilt[lvl], [this, lvl]() {
+    bilinears[lvl].reset(new BilinearInterpolator(images[lvl]));
+  });
+  return *bilinears[lvl];
+}
+
 } // namespace fishdso
@@ -124,7 +124,7 @@ It should contain "info" and "data" subdirectories.)abacaba";
   for (const std::string &a : argsVec)
     argsOfs << a << "\n";
 
-  MultiFovReader reader(argv[1]);
+  MultiFovReader reader(argv[1], getFlaggedSettings().cameraModel);
 
   if (FLAGS_gen_gt_only) {
     std::vector<std::vector<Vec3>> pointsInFrameGT(reader.getFrameCount());
@@ -215,6 +215,10 @@ It should contain "info" and "data" subdirectories.)abacaba";
       }
     }
 
+    // debug drawers look into the keyframes, which belong to mapping
+    if (FLAGS_write_files || FLAGS_show_debug_image)
+      dso.waitForMapping();
+
     if (FLAGS_write_files) {
       cv::Mat3b debugImage = debugImageDrawer.draw();
       cv::imwrite(debugDir / ("frame#" + std::to_string(it) + ".jpg"),
@@ -1,7 +1,8 @@
 #include "MultiFovReader.h"
 #include "util/types.h"
 
-MultiFovReader::MultiFovReader(const std::string &newMultiFovDir)
+MultiFovReader::MultiFovReader(const std::string &newMultiFovDir,
+                               const Settings::CameraModel &camSettings)
     : datasetDir(newMultiFovDir) {
   if (datasetDir.back() == '/')
     datasetDir = datasetDir.substr(0, datasetDir.size() - 1);
@@ -26,8 +27,9 @@ MultiFovReader::MultiFovReader(const std::string &newMultiFovDir)
   if (camIfsLine.size() < 3)
     throw std::runtime_error("inappropriate intrinsics format");
   if (camIfsLine.substr(0, 3) == "K =") {
-    cam = std::unique_ptr<CameraModel>(new CameraModel(
-        defaultWidth, defaultHeight, pinholeF, pinholeCx, pinholeCy));
+    cam = std::unique_ptr<CameraModel>(
+        new CameraModel(defaultWidth, defaultHeight, pinholeF, pinholeCx,
+                        pinholeCy, CameraModel::PINHOLE, camSettings));
   } else {
     std::stringstream strIfs(camIfsLine);
     int width, height;
@@ -42,7 +44,7 @@ MultiFovReader::MultiFovReader(const std::string &newMultiFovDir)
     ourCoeffs *= -1;
     strIfs >> center[0] >> center[1];
     cam = std::unique_ptr<CameraModel>(
-        new CameraModel(width, height, 1.0, center, ourCoeffs));
+        new CameraModel(width, height, 1.0, center, ourCoeffs, camSettings));
   }
 
   char posesFName[256];
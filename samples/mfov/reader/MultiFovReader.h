@@ -10,7 +10,8 @@ using namespace fishdso;
 
 class MultiFovReader {
 public:
-  MultiFovReader(const std::string &newDatasetDir);
+  MultiFovReader(const std::string &newDatasetDir,
+                 const Settings::CameraModel &camSettings = {});
 
   cv::Mat getFrame(int globalFrameNum) const;
   cv::Mat1d getDepths(int globalFrameNum) const;
@@ -31,8 +31,9 @@ KeyFrame kfFromEpipolar(CameraModel *cam, const cv::Mat &baseFrame,
 
   auto deb = FLAGS_show_epipolar ? ImmaturePoint::DRAW_EPIPOLE
                                  : ImmaturePoint::NO_DEBUG;
-  for (const auto &ip : result.immaturePoints)
-    ip->traceOn(result, toTraceOn, deb);
+  ImmaturePoint::TracingContext context;
+  for (auto &ip : result.immaturePoints)
+    ip.traceOn(result, toTraceOn, deb, context);
 
   return result;
 }
@@ -128,8 +129,8 @@ public:
       if (FLAGS_show_all) {
         std::vector<double> depths;
         for (const auto &ip : keyFrame.immaturePoints)
-          if (ip->state == ImmaturePoint::ACTIVE && ip->maxDepth != INF)
-            depths.push_back(ip->depth);
+          if (ip.state == ImmaturePoint::ACTIVE && ip.maxDepth != INF)
+            depths.push_back(ip.depth);
         setDepthColBounds(depths);
         cv::imshow("traced points",
                    keyFrame.drawDepthedFrame(minDepthCol, maxDepthCol));
@@ -138,31 +139,31 @@ public:
 
       cv::Mat1d dGT = reader->getDepths(firstFrameNum);
       for (const auto &ip : keyFrame.immaturePoints) {
-        if (ip->state != ImmaturePoint::ACTIVE || ip->maxDepth == INF)
+        if (ip.state != ImmaturePoint::ACTIVE || ip.maxDepth == INF)
           continue;
-        double depthGT = dGT(toCvPoint(ip->p));
+        double depthGT = dGT(toCvPoint(ip.p));
         Vec2 reprojGT = reader->cam->map(
             firstToSecondGT *
-            (depthGT * reader->cam->unmap(ip->p).normalized()));
+            (depthGT * reader->cam->unmap(ip.p).normalized()));
         Vec2 reproj = reader->cam->map(
             firstToSecond *
-            (ip->depth * reader->cam->unmap(ip->p).normalized()));
+            (ip.depth * reader->cam->unmap(ip.p).normalized()));
         Vec2 reprojBef = reader->cam->map(
             firstToSecond *
-            (ip->depthBeforeSubpixel * reader->cam->unmap(ip->p).normalized()));
+            (ip.depthBeforeSubpixel * reader->cam->unmap(ip.p).normalized()));
 
         Vec2 reprojInfD = reader->cam->map(
-            firstToSecond.so3() * reader->cam->unmap(ip->p).normalized());
+            firstToSecond.so3() * reader->cam->unmap(ip.p).normalized());
         EpiErr e;
         e.disparity = (reproj - reprojInfD).norm();
-        e.expectedErr = std::sqrt(ip->lastFullVar);
+        e.expectedErr = std::sqrt(ip.lastFullVar);
         e.realErrBef = (reprojGT - reprojBef).norm();
         e.realErr = (reprojGT - reproj).norm();
         e.depthGT = depthGT;
-        e.depth = ip->depth;
-        e.depthBeforeSubpixel = ip->depthBeforeSubpixel;
-        e.eBeforeSubpixel = ip->eBeforeSubpixel;
-        e.eAfterSubpixel = ip->eAfterSubpixel;
+        e.depth = ip.depth;
+        e.depthBeforeSubpixel = ip.depthBeforeSubpixel;
+        e.eBeforeSubpixel = ip.eBeforeSubpixel;
+        e.eAfterSubpixel = ip.eAfterSubpixel;
         errors[ind].push_back(e);
       }
     }
@@ -218,7 +219,7 @@ It should contain "info" and "data" subdirectories.)abacaba";
     return 1;
   }
 
-  MultiFovReader reader(argv[1]);
+  MultiFovReader reader(argv[1], getFlaggedSettings().cameraModel);
   collectEpipolarStat(reader);
 
   return 0;
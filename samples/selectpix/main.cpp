@@ -50,7 +50,7 @@ Where dir names a directory with images with .jpg extension
       cv::Mat im = cvtBgrToGray(imCol);
       if (!im.data)
         continue;
-      cv::Mat1d gradX, gradY, gradNorm;
+      cv::Mat1f gradX, gradY, gradNorm;
       grad(im, gradX, gradY, gradNorm);
       std::vector<cv::Point> points = pixelSelector.select(
           im, gradNorm, Settings::KeyFrame::default_pointsNum, &imCol);
@@ -16,8 +16,7 @@ void CloudWriter::keyFramesMarginalized(
     std::vector<cv::Vec3b> colors;
 
     for (const auto &op : kf->optimizedPoints) {
-      Vec3 worldPoint = kf->thisToWorld *
-                        (op->depth() * cam->unmap(op->p).normalized());
+      Vec3 worldPoint = kf->thisToWorld * (op->depth() * cam->unmapUnit(op->p));
       if (worldPoint[2] < MAX_DEPTH) { // MAX_DEPTH
         points.push_back(worldPoint);
         colors.push_back(
@@ -25,13 +24,12 @@ void CloudWriter::keyFramesMarginalized(
       }
     }
     for (const auto &ip : kf->immaturePoints) {
-      if (ip->numTraced > 0) {
-        Vec3 worldPoint = kf->thisToWorld *
-                          (ip->depth * cam->unmap(ip->p).normalized());
+      if (ip.numTraced > 0) {
+        Vec3 worldPoint = kf->thisToWorld * (ip.depth * cam->unmapUnit(ip.p));
         if (worldPoint[2] < MAX_DEPTH) { // MAX_DEPTH
           points.push_back(worldPoint);
           colors.push_back(
-              kf->preKeyFrame->frameColored.at<cv::Vec3b>(toCvPoint(ip->p)));
+              kf->preKeyFrame->frameColored.at<cv::Vec3b>(toCvPoint(ip.p)));
         }
       }
     }
@@ -61,7 +61,7 @@ cv::Mat3b DebugImageDrawer::draw() {
   cv::Mat3b usefulImg = base.clone();
   SE3 baseToLast = lastFrame->baseToThis;
   for (int i = 0; i < optPt.size(); ++i) {
-    Vec3 p = optD[i] * cam->unmap(optPt[i]).normalized();
+    Vec3 p = optD[i] * cam->unmapUnit(optPt[i]);
     Vec2 reproj = cam->map(baseToLast * p);
     cv::Scalar col = cam->isOnImage(reproj, settings.residualPattern.height)
                          ? CV_GREEN
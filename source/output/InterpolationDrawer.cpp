@@ -14,7 +14,7 @@ void InterpolationDrawer::initialized(
   std::vector<double> ipDepths;
   ipDepths.reserve(lastKeyFrame->immaturePoints.size());
   for (const auto &ip : lastKeyFrame->immaturePoints)
-    ipDepths.push_back(ip->depth);
+    ipDepths.push_back(ip.depth);
   setDepthColBounds(ipDepths);
 
   result = lastKeyFrame->preKeyFrame->frameColored.clone();
@@ -29,8 +29,8 @@ void InterpolationDrawer::initialized(
   std::vector<double> d;
   d.reserve(ips.size());
   for (const auto &ip : ips) {
-    pnts.push_back(ip->p);
-    d.push_back(ip->depth);
+    pnts.push_back(ip.p);
+    d.push_back(ip.depth);
   }
 
   lastTerrain->draw(result, cam, CV_GREEN, minDepthCol, maxDepthCol);
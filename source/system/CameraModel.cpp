@@ -4,33 +4,110 @@
 #include "util/settings.h"
 #include "util/types.h"
 #include <algorithm>
-#include <ceres/ceres.h>
 #include <fstream>
+#include <functional>
+#include <glog/logging.h>
 #include <iostream>
 #include <opencv2/opencv.hpp>
 #include <random>
+#include <sstream>
 #include <vector>
 
 namespace fishdso {
 
+// Calibration cache files start with this magic number followed by the format
+// version, bump it whenever the cached state changes.
+constexpr uint64_t cacheMagic = 0x314d41434f534446ull; // "FDSOCAM1"
+constexpr uint32_t cacheVersion = 1;
+
+// FNV-1a, unlike std::hash it is the same in every process
+uint64_t hashBytes(uint64_t hash, const void *data, size_t size) {
+  const unsigned char *bytes = static_cast<const unsigned char *>(data);
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+template <typename T> uint64_t hashValue(uint64_t hash, const T &value) {
+  return hashBytes(hash, &value, sizeof(T));
+}
+
+template <typename T> void writeRaw(std::ostream &os, const T &value) {
+  os.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+template <typename T> bool readRaw(std::istream &is, T &value) {
+  return bool(is.read(reinterpret_cast<char *>(&value), sizeof(T)));
+}
+
+fs::path cacheFile(const std::string &cacheDirectory, const std::string &prefix,
+                   uint64_t key) {
+  std::stringstream name;
+  name << prefix << '_' << std::hex << key << ".bin";
+  return fs::path(cacheDirectory) / name.str();
+}
+
+// Opens the cache file and checks its header. Returns false if there is no
+// valid cache entry for the key.
+bool openCache(const fs::path &fileName, uint64_t key, std::ifstream &ifs) {
+  ifs.open(fileName, std::ios::binary);
+  uint64_t magic, storedKey;
+  uint32_t version;
+  return ifs.is_open() && readRaw(ifs, magic) && magic == cacheMagic &&
+         readRaw(ifs, version) && version == cacheVersion &&
+         readRaw(ifs, storedKey) && storedKey == key;
+}
+
+// Writes the cache entry into a temporary file which is then renamed, so
+// concurrent processes never see a partially written entry. Failures only
+// disable caching.
+void storeCache(const fs::path &fileName, uint64_t key,
+                const std::function<void(std::ostream &)> &writePayload) {
+  std::error_code error;
+  fs::create_directories(fileName.parent_path(), error);
+  fs::path tmpName = fileName;
+  tmpName += ".tmp" + std::to_string(std::random_device()());
+  {
+    std::ofstream ofs(tmpName, std::ios::binary);
+    writeRaw(ofs, cacheMagic);
+    writeRaw(ofs, cacheVersion);
+    writeRaw(ofs, key);
+    writePayload(ofs);
+    if (!ofs.good()) {
+      LOG(WARNING) << "could not write calibration cache " << tmpName;
+      fs::remove(tmpName, error);
+      return;
+    }
+  }
+  fs::rename(tmpName, fileName, error);
+  if (error) {
+    LOG(WARNING) << "could not write calibration cache " << fileName << ": "
+                 << error.message();
+    fs::remove(tmpName, error);
+  }
+}
+
 CameraModel::CameraModel(int width, int height, double scale,
                          const Vec2 &center, VecX unmapPolyCoeffs,
                          const Settings::CameraModel &settings)
-    : width(width)
+    : type(POLYNOMIAL)
+    , width(width)
     , height(height)
     , unmapPolyDeg(unmapPolyCoeffs.rows())
     , unmapPolyCoeffs(unmapPolyCoeffs)
     , center(center)
     , scale(scale)
     , settings(settings) {
-  normalize();
-  setMapPolyCoeffs();
+  calibrate();
 }
 
 CameraModel::CameraModel(int width, int height,
                          const std::string &calibFileName,
                          const Settings::CameraModel &settings)
-    : width(width)
+    : type(POLYNOMIAL)
+    , width(width)
     , height(height)
     , settings(settings) {
   std::ifstream ifs(calibFileName, std::ifstream::in);
@@ -38,28 +115,108 @@ CameraModel::CameraModel(int width, int height,
     throw std::runtime_error("camera model file could not be open!");
   }
   ifs >> *this;
-  normalize();
-  setMapPolyCoeffs();
+  calibrate();
 }
 
 CameraModel::CameraModel(int width, int height, double f, double cx, double cy,
-                         const Settings::CameraModel &settings)
-    : width(width)
+                         Type type, const Settings::CameraModel &settings)
+    : type(type)
+    , width(width)
     , height(height)
     , unmapPolyDeg(0)
     , center(cx, cy)
     , scale(1)
     , settings(settings) {
+  CHECK(type == PINHOLE || type == EQUIDISTANT)
+      << "only pinhole and equidistant cameras are defined by f";
   unmapPolyCoeffs.resize(1, 1);
   unmapPolyCoeffs[0] = f;
-  normalize();
-  setMapPolyCoeffs();
+  calibrate();
 
   LOG(INFO) << "\n\n CAMERA MODEL:\n";
   LOG(INFO) << "unmap coeffs  = " << unmapPolyCoeffs.transpose() << "\n";
   LOG(INFO) << "\nmap poly coeffs = " << mapPolyCoeffs.transpose() << "\n\n";
 }
 
+void CameraModel::calibrate() {
+  if (settings.cacheDirectory.empty()) {
+    normalize();
+    setMapPolyCoeffs();
+  } else {
+    // the key is computed from the intrinsics as they were given, before
+    // normalization
+    uint64_t key = 14695981039346656037ull;
+    key = hashValue(key, type);
+    key = hashValue(key, width);
+    key = hashValue(key, height);
+    key = hashValue(key, scale);
+    key = hashValue(key, center);
+    key = hashValue(key, unmapPolyDeg);
+    key = hashBytes(key, unmapPolyCoeffs.data(),
+                    unmapPolyCoeffs.size() * sizeof(double));
+    key = hashValue(key, settings.mapPolyDegree);
+    key = hashValue(key, settings.mapPolyPoints);
+
+    fs::path fileName = cacheFile(settings.cacheDirectory, "camera", key);
+    if (!loadCalibration(fileName, key)) {
+      normalize();
+      setMapPolyCoeffs();
+      storeCache(fileName, key, [this](std::ostream &os) {
+        writeRaw(os, type);
+        writeRaw(os, scale);
+        writeRaw(os, center);
+        writeRaw(os, maxRadius);
+        writeRaw(os, minZ);
+        writeRaw(os, maxAngle);
+        for (int i = 0; i < unmapPolyCoeffs.size(); ++i)
+          writeRaw(os, unmapPolyCoeffs[i]);
+        int mapPolyCoeffsNum = mapPolyCoeffs.size();
+        writeRaw(os, mapPolyCoeffsNum);
+        for (int i = 0; i < mapPolyCoeffsNum; ++i)
+          writeRaw(os, mapPolyCoeffs[i]);
+      });
+    }
+  }
+
+  if (settings.useRayTable)
+    setRayTable();
+}
+
+bool CameraModel::loadCalibration(const fs::path &fileName, uint64_t key) {
+  std::ifstream ifs;
+  if (!openCache(fileName, key, ifs))
+    return false;
+
+  Type newType;
+  double newScale, newMaxRadius, newMinZ, newMaxAngle;
+  Vec2 newCenter;
+  VecX newUnmapPolyCoeffs(unmapPolyCoeffs.size());
+  int mapPolyCoeffsNum;
+  bool ok = readRaw(ifs, newType) && readRaw(ifs, newScale) &&
+            readRaw(ifs, newCenter) && readRaw(ifs, newMaxRadius) &&
+            readRaw(ifs, newMinZ) && readRaw(ifs, newMaxAngle);
+  for (int i = 0; ok && i < newUnmapPolyCoeffs.size(); ++i)
+    ok = readRaw(ifs, newUnmapPolyCoeffs[i]);
+  ok = ok && readRaw(ifs, mapPolyCoeffsNum) && mapPolyCoeffsNum > 0 &&
+       mapPolyCoeffsNum <= mapPolyCoeffs.MaxRowsAtCompileTime;
+  if (!ok)
+    return false;
+  decltype(mapPolyCoeffs) newMapPolyCoeffs(mapPolyCoeffsNum);
+  for (int i = 0; i < mapPolyCoeffsNum; ++i)
+    if (!readRaw(ifs, newMapPolyCoeffs[i]))
+      return false;
+
+  type = newType;
+  scale = newScale;
+  center = newCenter;
+  maxRadius = newMaxRadius;
+  minZ = newMinZ;
+  maxAngle = newMaxAngle;
+  unmapPolyCoeffs = newUnmapPolyCoeffs;
+  mapPolyCoeffs = newMapPolyCoeffs;
+  return true;
+}
+
 void CameraModel::normalize() {
   double wd = width, hd = height;
   Vec2 imcenter = center * scale;
@@ -83,19 +240,6 @@ void CameraModel::normalize() {
   maxAngle = std::atan2(maxRadius, minZUnnorm);
 }
 
-std::pair<Vec2, Mat23> CameraModel::diffMap(const Vec3 &ray) const {
-  ceres::Jet<double, 3> rayJet[3];
-  for (int i = 0; i < 3; ++i) {
-    rayJet[i].a = ray[i];
-    rayJet[i].v.setZero();
-    rayJet[i].v[i] = 1;
-  }
-  Eigen::Matrix<ceres::Jet<double, 3>, 2, 1> pointJet = map(rayJet);
-  Mat23 mapJacobian;
-  mapJacobian << pointJet[0].v.transpose(), pointJet[1].v.transpose();
-  return {Vec2(pointJet[0].a, pointJet[1].a), mapJacobian};
-}
-
 bool CameraModel::isOnImage(const Vec2 &p, int border) const {
   return Eigen::AlignedBox2d(Vec2(border, border),
                              Vec2(width - border, height - border))
@@ -136,6 +280,7 @@ void CameraModel::setMapPolyCoeffs() {
   // in the image and \theta stands for angle to z-axis of the unprojected ray
   int nPnts = settings.mapPolyPoints;
   int deg = settings.mapPolyDegree;
+  CHECK_LE(deg, Settings::CameraModel::max_mapPolyDegree);
   StdVector<Vec2> funcGraph;
   funcGraph.reserve(nPnts);
   std::mt19937 gen(FLAGS_deterministic ? 42 : std::random_device()());
@@ -171,6 +316,116 @@ void CameraModel::setMapPolyCoeffs() {
   }
 
   mapPolyCoeffs = A.fullPivHouseholderQr().solve(b);
+
+  if (type == POLYNOMIAL || type == POLYNOMIAL_FIXED)
+    type = deg == Settings::CameraModel::default_mapPolyDegree
+               ? POLYNOMIAL_FIXED
+               : POLYNOMIAL;
+}
+
+void CameraModel::mapBatch(const StdVector<Vec3> &rays,
+                           StdVector<Vec2> &points) const {
+  int n = rays.size();
+  points.resize(n);
+  if (n == 0)
+    return;
+  Eigen::Map<const Eigen::Matrix3Xd> R(rays[0].data(), 3, n);
+  Eigen::Map<Eigen::Matrix2Xd> P(points[0].data(), 2, n);
+
+  if (type == PINHOLE) {
+    Eigen::ArrayXd z = R.row(2).transpose();
+    Eigen::ArrayXd factor = (z > 0).select(scale * unmapPolyCoeffs[0] / z, 0.0);
+    P = R.topRows<2>() * factor.matrix().asDiagonal();
+    P.colwise() += scale * center;
+    for (int i = 0; i < n; ++i)
+      if (z[i] <= 0)
+        points[i] = Vec2(-1, -1);
+    return;
+  }
+
+  Eigen::ArrayXd rho = R.topRows<2>().colwise().norm().transpose();
+  Eigen::ArrayXd angle(n);
+  for (int i = 0; i < n; ++i)
+    angle[i] = std::atan2(rho[i], R(2, i));
+
+  Eigen::ArrayXd r;
+  if (type == EQUIDISTANT)
+    r = unmapPolyCoeffs[0] * angle;
+  else {
+    int deg = mapPolyCoeffs.rows() - 1;
+    r = Eigen::ArrayXd::Constant(n, mapPolyCoeffs[deg]);
+    for (int i = deg - 1; i >= 0; --i)
+      r = r * angle + mapPolyCoeffs[i];
+  }
+
+  // rays along the axis are mapped to the center, as in map
+  Eigen::ArrayXd factor = (rho > 0).select(scale * r / rho, 0.0);
+  P = R.topRows<2>() * factor.matrix().asDiagonal();
+  P.colwise() += scale * center;
+}
+
+void CameraModel::unmapBatch(const StdVector<Vec2> &points,
+                             StdVector<Vec3> &rays) const {
+  int n = points.size();
+  rays.resize(n);
+  if (n == 0)
+    return;
+  Eigen::Map<const Eigen::Matrix2Xd> P(points[0].data(), 2, n);
+  Eigen::Map<Eigen::Matrix3Xd> R(rays[0].data(), 3, n);
+
+  R.topRows<2>() = (P / scale).colwise() - center;
+  Eigen::ArrayXd rho2 = R.topRows<2>().colwise().squaredNorm().transpose();
+  Eigen::ArrayXd rho = rho2.sqrt();
+
+  if (type == EQUIDISTANT) {
+    double f = unmapPolyCoeffs[0];
+    R.row(2) = (rho > 0).select(rho / (rho / f).tan(), f).matrix().transpose();
+    return;
+  }
+
+  Eigen::ArrayXd z = Eigen::ArrayXd::Zero(n);
+  for (int i = unmapPolyDeg - 1; i >= 1; --i)
+    z = z * rho + unmapPolyCoeffs[i];
+  R.row(2) = (unmapPolyCoeffs[0] + rho2 * z).matrix().transpose();
+}
+
+void CameraModel::setRayTable() {
+  int tableSize = (width + 1) * (height + 1);
+  std::vector<Vec3f> table(tableSize);
+
+  // the table depends only on the normalized state and the size
+  uint64_t key = 14695981039346656037ull;
+  fs::path fileName;
+  if (!settings.cacheDirectory.empty()) {
+    key = hashValue(key, type);
+    key = hashValue(key, width);
+    key = hashValue(key, height);
+    key = hashValue(key, scale);
+    key = hashValue(key, center);
+    key = hashBytes(key, unmapPolyCoeffs.data(),
+                    unmapPolyCoeffs.size() * sizeof(double));
+    fileName = cacheFile(settings.cacheDirectory, "rays", key);
+
+    std::ifstream ifs;
+    if (openCache(fileName, key, ifs) &&
+        ifs.read(reinterpret_cast<char *>(table.data()),
+                 tableSize * sizeof(Vec3f))) {
+      rayTable = std::make_shared<const std::vector<Vec3f>>(std::move(table));
+      return;
+    }
+  }
+
+  for (int y = 0; y <= height; ++y)
+    for (int x = 0; x <= width; ++x)
+      table[y * (width + 1) + x] =
+          unmap(Vec2(x, y)).normalized().cast<float>();
+
+  if (!fileName.empty())
+    storeCache(fileName, key, [&table, tableSize](std::ostream &os) {
+      os.write(reinterpret_cast<const char *>(table.data()),
+               tableSize * sizeof(Vec3f));
+    });
+  rayTable = std::make_shared<const std::vector<Vec3f>>(std::move(table));
 }
 
 StdVector<CameraModel> CameraModel::camPyr(int pyrLevels) {
@@ -179,6 +434,8 @@ StdVector<CameraModel> CameraModel::camPyr(int pyrLevels) {
     result[i].scale /= (1 << i);
     result[i].width /= (1 << i);
     result[i].height /= (1 << i);
+    if (i > 0 && rayTable)
+      result[i].setRayTable();
   }
 
   return result;
@@ -0,0 +1,331 @@
+#include "system/CeresBundleAdjuster.h"
+#include "DirectResidual.h"
+#include "PreKeyFrameInternals.h"
+#include "system/AffineLightTransform.h"
+#include "system/SphericalPlus.h"
+#include "util/defs.h"
+#include "util/geometry.h"
+#include "util/util.h"
+#include <ceres/ceres.h>
+#include <ceres/cubic_interpolation.h>
+#include <ceres/local_parameterization.h>
+#include <unordered_map>
+
+namespace fishdso {
+
+struct CeresBundleAdjuster::Internals {
+  struct Residual {
+    ceres::ResidualBlockId id;
+    DirectResidual *residual;
+  };
+  typedef std::map<KeyFrame *, Residual> ResidualsByRef;
+
+  Internals()
+      : problem(problemOptions())
+      , ordering(new ceres::ParameterBlockOrdering()) {}
+
+  static ceres::Problem::Options problemOptions() {
+    ceres::Problem::Options options;
+    options.enable_fast_removal = true;
+    return options;
+  }
+
+  ceres::Problem problem;
+  std::shared_ptr<ceres::ParameterBlockOrdering> ordering;
+  std::unordered_map<OptimizedPoint *, ResidualsByRef> residuals;
+};
+
+CeresBundleAdjuster::CeresBundleAdjuster(
+    CameraModel *cam, const BundleAdjusterSettings &_settings)
+    : cam(cam)
+    , firstKeyFrame(nullptr)
+    , secondKeyFrame(nullptr)
+    , internals(new Internals())
+    , settings(_settings) {}
+
+CeresBundleAdjuster::~CeresBundleAdjuster() {}
+
+bool CeresBundleAdjuster::isOOB(const SE3 &baseToWorld,
+                                const SE3 &refToWorld,
+                                const OptimizedPoint &baseOP) {
+  Vec3 inBase = cam->unmapUnit(baseOP.p) * baseOP.depth();
+  Vec2 reproj = cam->map(refToWorld.inverse() * baseToWorld * inBase);
+  return !cam->isOnImage(reproj, settings.residualPattern.height);
+}
+
+void CeresBundleAdjuster::addKeyFrame(KeyFrame *keyFrame) {
+  ceres::Problem &problem = internals->problem;
+  ceres::ParameterBlockOrdering &ordering = *internals->ordering;
+
+  problem.AddParameterBlock(keyFrame->thisToWorld.translation().data(), 3);
+  problem.AddParameterBlock(keyFrame->thisToWorld.so3().data(), 4,
+                            new ceres::EigenQuaternionParameterization());
+  auto affLight = keyFrame->lightWorldToThis.data;
+  problem.AddParameterBlock(affLight, 2);
+  problem.SetParameterLowerBound(affLight, 0,
+                                 settings.affineLight.minAffineLightA);
+  problem.SetParameterUpperBound(affLight, 0,
+                                 settings.affineLight.maxAffineLightA);
+  problem.SetParameterLowerBound(affLight, 1,
+                                 settings.affineLight.minAffineLightB);
+  problem.SetParameterUpperBound(affLight, 1,
+                                 settings.affineLight.maxAffineLightB);
+
+  ordering.AddElementToGroup(keyFrame->thisToWorld.translation().data(), 1);
+  ordering.AddElementToGroup(keyFrame->thisToWorld.so3().data(), 1);
+  ordering.AddElementToGroup(affLight, 1);
+
+  keyFrames.push_back(keyFrame);
+}
+
+void CeresBundleAdjuster::marginalizeKeyFrame(KeyFrame *keyFrame) {
+  auto kfIt = std::find(keyFrames.begin(), keyFrames.end(), keyFrame);
+  CHECK(kfIt != keyFrames.end());
+
+  ceres::Problem &problem = internals->problem;
+  ceres::ParameterBlockOrdering &ordering = *internals->ordering;
+
+  for (auto &[op, pointResiduals] : internals->residuals)
+    if (pointResiduals.count(keyFrame))
+      removeResiduals(op, keyFrame);
+
+  // removing the depth block also removes all residuals depending on it
+  for (const auto &op : keyFrame->optimizedPoints) {
+    auto it = internals->residuals.find(op.get());
+    if (it == internals->residuals.end())
+      continue;
+    problem.RemoveParameterBlock(&op->logInvDepth);
+    ordering.Remove(&op->logInvDepth);
+    internals->residuals.erase(it);
+  }
+
+  for (double *block : {keyFrame->thisToWorld.translation().data(),
+                        keyFrame->thisToWorld.so3().data(),
+                        keyFrame->lightWorldToThis.data}) {
+    problem.RemoveParameterBlock(block);
+    ordering.Remove(block);
+  }
+
+  keyFrames.erase(kfIt);
+  if (keyFrame == firstKeyFrame)
+    firstKeyFrame = nullptr;
+  if (keyFrame == secondKeyFrame)
+    secondKeyFrame = nullptr;
+}
+
+void CeresBundleAdjuster::updateGauge() {
+  ceres::Problem &problem = internals->problem;
+
+  for (int i = 1; i < keyFrames.size(); ++i) {
+    KeyFrame *kf = keyFrames[i];
+    problem.SetParameterBlockVariable(kf->thisToWorld.translation().data());
+    problem.SetParameterBlockVariable(kf->thisToWorld.so3().data());
+    if (settings.affineLight.optimizeAffineLight)
+      problem.SetParameterBlockVariable(kf->lightWorldToThis.data);
+    else
+      problem.SetParameterBlockConstant(kf->lightWorldToThis.data);
+  }
+
+  firstKeyFrame = keyFrames[0];
+  problem.SetParameterBlockConstant(
+      firstKeyFrame->thisToWorld.translation().data());
+  problem.SetParameterBlockConstant(firstKeyFrame->thisToWorld.so3().data());
+  problem.SetParameterBlockConstant(firstKeyFrame->lightWorldToThis.data);
+
+  // Keyframes are ordered by age, so each of them becomes the second one at
+  // most once and its translation gets the spherical parameterization only
+  // once, as Ceres requires.
+  if (secondKeyFrame != keyFrames[1]) {
+    secondKeyFrame = keyFrames[1];
+    SE3 firstToWorld = firstKeyFrame->thisToWorld;
+    SE3 secondToWorld = secondKeyFrame->thisToWorld;
+    double radius =
+        (secondToWorld.translation() - firstToWorld.translation()).norm();
+    Vec3 center = firstToWorld.translation();
+    problem.SetParameterization(
+        secondKeyFrame->thisToWorld.translation().data(),
+        new ceres::AutoDiffLocalParameterization<SphericalPlus, 3, 2>(
+            new SphericalPlus(center, radius, secondToWorld.translation())));
+  }
+
+  if (settings.bundleAdjuster.fixedRotationOnSecondKF)
+    problem.SetParameterBlockConstant(secondKeyFrame->thisToWorld.so3().data());
+
+  if (settings.bundleAdjuster.fixedMotionOnFirstAdjustent &&
+      keyFrames.size() == 2) {
+    problem.SetParameterBlockConstant(
+        secondKeyFrame->thisToWorld.translation().data());
+    problem.SetParameterBlockConstant(secondKeyFrame->thisToWorld.so3().data());
+    problem.SetParameterBlockConstant(secondKeyFrame->lightWorldToThis.data);
+  }
+}
+
+void CeresBundleAdjuster::addResiduals(KeyFrame *baseFrame,
+                                       KeyFrame *refFrame,
+                                       OptimizedPoint *op) {
+  const StdVector<Vec2> &pattern = settings.residualPattern.pattern();
+  const double c = settings.gradWeighting.c;
+  std::vector<double> weights(pattern.size());
+  for (int i = 0; i < pattern.size(); ++i) {
+    double gradNorm =
+        baseFrame->preKeyFrame->gradNorm()(toCvPoint(Vec2(op->p + pattern[i])));
+    weights[i] = c / std::hypot(c, gradNorm);
+  }
+
+  DirectResidual *newResidual = new DirectResidual(
+      &baseFrame->preKeyFrame->internals->interpolator(0),
+      &refFrame->preKeyFrame->internals->interpolator(0), cam, op, pattern,
+      weights, settings.intencity.outlierDiff, baseFrame, refFrame);
+  ceres::ResidualBlockId id = internals->problem.AddResidualBlock(
+      newResidual, nullptr, &op->logInvDepth,
+      baseFrame->thisToWorld.translation().data(),
+      baseFrame->thisToWorld.so3().data(),
+      refFrame->thisToWorld.translation().data(),
+      refFrame->thisToWorld.so3().data(), baseFrame->lightWorldToThis.data,
+      refFrame->lightWorldToThis.data);
+  internals->residuals[op][refFrame] = {id, newResidual};
+}
+
+void CeresBundleAdjuster::removeResiduals(OptimizedPoint *op,
+                                          KeyFrame *refFrame) {
+  Internals::ResidualsByRef &pointResiduals = internals->residuals[op];
+  auto it = pointResiduals.find(refFrame);
+  if (it == pointResiduals.end())
+    return;
+  internals->problem.RemoveResidualBlock(it->second.id);
+  pointResiduals.erase(it);
+}
+
+void CeresBundleAdjuster::updateResiduals() {
+  ceres::Problem &problem = internals->problem;
+  int pointsTotal = 0, pointsOOB = 0, pointsNew = 0, numNonfiniteDepths = 0;
+  int residualsAdded = 0, residualsRemoved = 0;
+
+  for (KeyFrame *baseFrame : keyFrames)
+    for (const auto &op : baseFrame->optimizedPoints) {
+      if (!std::isfinite(op->logInvDepth)) {
+        numNonfiniteDepths++;
+        continue;
+      }
+
+      auto it = internals->residuals.find(op.get());
+      if (it == internals->residuals.end()) {
+        problem.AddParameterBlock(&op->logInvDepth, 1);
+        problem.SetParameterLowerBound(&op->logInvDepth, 0,
+                                       -std::log(settings.depth.max));
+        problem.SetParameterUpperBound(&op->logInvDepth, 0,
+                                       -std::log(settings.depth.min));
+        internals->ordering->AddElementToGroup(&op->logInvDepth, 0);
+        it = internals->residuals.insert({op.get(), {}}).first;
+        pointsNew++;
+      }
+
+      for (KeyFrame *refFrame : keyFrames) {
+        if (refFrame == baseFrame)
+          continue;
+        pointsTotal++;
+        bool hasResiduals = it->second.count(refFrame);
+        if (isOOB(baseFrame->thisToWorld, refFrame->thisToWorld, *op)) {
+          pointsOOB++;
+          if (hasResiduals) {
+            removeResiduals(op.get(), refFrame);
+            residualsRemoved++;
+          }
+        } else if (!hasResiduals) {
+          addResiduals(baseFrame, refFrame, op.get());
+          residualsAdded++;
+        }
+      }
+    }
+
+  if (numNonfiniteDepths != 0)
+    LOG(WARNING) << "found " << numNonfiniteDepths << "nonfinite depths";
+
+  LOG(INFO) << "BA problem update:";
+  LOG(INFO) << "total points = " << pointsTotal;
+  LOG(INFO) << "OOB points = " << pointsOOB;
+  LOG(INFO) << "new points = " << pointsNew;
+  LOG(INFO) << "point-frame residuals added = " << residualsAdded
+            << ", removed = " << residualsRemoved;
+}
+
+void CeresBundleAdjuster::adjust(int maxNumIterations) {
+  if (keyFrames.size() < 2) {
+    LOG(WARNING) << "too few keyframes to run bundle adjustment";
+    return;
+  }
+
+  updateGauge();
+
+  LOG(INFO) << "points on the first = " << firstKeyFrame->optimizedPoints.size()
+            << std::endl;
+  LOG(INFO) << "points on the second = "
+            << secondKeyFrame->optimizedPoints.size() << std::endl;
+
+  updateResiduals();
+
+  ceres::Solver::Options options;
+  options.linear_solver_type = ceres::DENSE_SCHUR;
+  options.linear_solver_ordering = internals->ordering;
+  // options.minimizer_progress_to_stdout = true;
+  options.max_num_iterations = maxNumIterations;
+  options.num_threads = settings.threading.numThreads;
+  ceres::Solver::Summary summary;
+  ceres::Solve(options, &internals->problem, &summary);
+
+  if (secondKeyFrame->optimizedPoints.size() > 0) {
+    auto p = std::minmax_element(secondKeyFrame->optimizedPoints.begin(),
+                                 secondKeyFrame->optimizedPoints.end(),
+                                 [](const auto &op1, const auto &op2) {
+                                   return op1->depth() < op2->depth();
+                                 });
+    LOG(INFO) << "minmax d = " << (*p.first)->depth() << ' '
+              << (*p.second)->depth() << std::endl;
+  }
+
+  std::vector<double> depthsVec;
+  depthsVec.reserve(secondKeyFrame->optimizedPoints.size());
+  for (const auto &op : secondKeyFrame->optimizedPoints)
+    depthsVec.push_back(op->depth());
+  // setDepthColBounds(depthsVec);
+
+  cv::Mat kfDepths = secondKeyFrame->drawDepthedFrame(minDepthCol, maxDepthCol);
+
+  StdVector<Vec2> outliers;
+  StdVector<Vec2> badDepth;
+  for (const auto &op : secondKeyFrame->optimizedPoints) {
+    if (op->state == OptimizedPoint::OOB)
+      continue;
+
+    auto pointResiduals = internals->residuals.find(op.get());
+    if (pointResiduals == internals->residuals.end())
+      continue;
+
+    std::vector<double> values;
+    for (const auto &[refFrame, refResidual] : pointResiduals->second) {
+      std::vector<double> refValues =
+          refResidual.residual->values(op->logInvDepth);
+      values.insert(values.end(), refValues.begin(), refValues.end());
+    }
+
+    if (values.empty()) {
+      op->state = OptimizedPoint::OOB;
+      continue;
+    }
+
+    std::nth_element(values.begin(), values.begin() + values.size() / 2,
+                     values.end());
+    double median = values[values.size() / 2];
+    if (median > settings.intencity.outlierDiff) {
+      op->state = OptimizedPoint::OUTLIER;
+      outliers.push_back(op->p);
+    }
+  }
+  int pointsOutliers = outliers.size();
+
+  LOG(INFO) << "BA results:";
+  LOG(INFO) << "outlier points = " << pointsOutliers;
+
+  LOG(INFO) << summary.FullReport() << std::endl;
+}
+} // namespace fishdso
@@ -61,8 +61,8 @@ StdVector<KeyFrame> DelaunayDsoInitializer::createKeyFrames() {
     keyFrames.push_back(KeyFrame(cam, frames[i], globalFrameNums[i],
                                  *pixelSelector, settings.keyFrame,
                                  settings.tracingSettings));
-    for (const auto &ip : keyFrames.back().immaturePoints)
-      ip->stddev = 1;
+    for (auto &ip : keyFrames.back().immaturePoints)
+      ip.stddev = 1;
   }
 
   keyFrames[0].thisToWorld = SE3();
@@ -73,13 +73,13 @@ StdVector<KeyFrame> DelaunayDsoInitializer::createKeyFrames() {
         Terrain(cam, keyPoints[0], depths[0], settings.triangulation),
         Terrain(cam, keyPoints[1], depths[1], settings.triangulation)};
     for (int i = 0; i < 2; ++i) {
-      for (const auto &ip : keyFrames[i].immaturePoints) {
+      for (auto &ip : keyFrames[i].immaturePoints) {
         double depth;
-        if (kpTerrains[i](ip->p, depth)) {
-          ip->state = ImmaturePoint::ACTIVE;
-          ip->depth = depth;
+        if (kpTerrains[i](ip.p, depth)) {
+          ip.state = ImmaturePoint::ACTIVE;
+          ip.depth = depth;
         } else
-          ip->state = ImmaturePoint::OOB;
+          ip.state = ImmaturePoint::OOB;
       }
     }
   } else {
@@ -99,25 +99,24 @@ StdVector<KeyFrame> DelaunayDsoInitializer::createKeyFrames() {
     for (int kfInd = 0; kfInd < 2; ++kfInd) {
       const int reselectCount = 1;
       for (int i = 0; i < reselectCount + 1; ++i) {
-        for (const auto &ip : keyFrames[kfInd].immaturePoints) {
+        for (auto &ip : keyFrames[kfInd].immaturePoints) {
           double depth;
-          if (ip->state == ImmaturePoint::ACTIVE &&
-              kpTerrains[kfInd](cam->unmap(ip->p.data()), depth)) {
-            ip->state = ImmaturePoint::ACTIVE;
-            ip->depth = depth;
+          if (ip.state == ImmaturePoint::ACTIVE &&
+              kpTerrains[kfInd](cam->unmap(ip.p.data()), depth)) {
+            ip.state = ImmaturePoint::ACTIVE;
+            ip.depth = depth;
           } else
-            ip->state = ImmaturePoint::OOB;
+            ip.state = ImmaturePoint::OOB;
         }
 
         int pointsTotal = keyFrames[kfInd].immaturePoints.size();
 
-        auto it = keyFrames[kfInd].immaturePoints.begin();
-        while (it != keyFrames[kfInd].immaturePoints.end()) {
-          if ((*it)->state != ImmaturePoint::ACTIVE)
-            it = keyFrames[kfInd].immaturePoints.erase(it);
-          else
-            it++;
-        }
+        auto &ips = keyFrames[kfInd].immaturePoints;
+        ips.erase(std::remove_if(ips.begin(), ips.end(),
+                                 [](const ImmaturePoint &ip) {
+                                   return ip.state != ImmaturePoint::ACTIVE;
+                                 }),
+                  ips.end());
 
         int pointsInTriang = keyFrames[kfInd].immaturePoints.size();
         int newPointsNeeded =
@@ -2,16 +2,31 @@
 #include "output/DsoObserver.h"
 #include "output/FrameTrackerObserver.h"
 #include "system/AffineLightTransform.h"
+#include "system/CeresBundleAdjuster.h"
 #include "system/DelaunayDsoInitializer.h"
+#include "system/SlidingWindowBundleAdjuster.h"
 #include "system/StereoMatcher.h"
 #include "system/serialization.h"
 #include "util/defs.h"
 #include "util/geometry.h"
 #include "util/settings.h"
+#include <algorithm>
 #include <glog/logging.h>
+#include <numeric>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/task_arena.h>
 
 namespace fishdso {
 
+BundleAdjuster *createBundleAdjuster(CameraModel *cam,
+                                     const Settings &settings) {
+  if (settings.bundleAdjuster.useCeres)
+    return new CeresBundleAdjuster(cam, settings.getBundleAdjusterSettings());
+  return new SlidingWindowBundleAdjuster(cam,
+                                         settings.getBundleAdjusterSettings());
+}
+
 DsoSystem::DsoSystem(CameraModel *cam, const Observers &observers,
                      const Settings &_settings)
     : lastInitialized(nullptr)
@@ -24,8 +39,15 @@ DsoSystem::DsoSystem(CameraModel *cam, const Observers &observers,
           DelaunayDsoInitializer::SPARSE_DEPTHS, observers.initializer,
           _settings.getInitializerSettings())))
     , isInitialized(false)
+    , trackingBase(nullptr)
+    , lastKeyFrameNum(-1)
+    , newTrackingBase(nullptr)
+    , bundleAdjuster(createBundleAdjuster(cam, _settings))
     , worldToFrame(_settings.initialMaxFrame)
     , worldToFramePredict(_settings.initialMaxFrame)
+    , pendingKeyFrames(0)
+    , isMapping(false)
+    , stopMapping(false)
     , lastTrackRmse(INF)
     , settings(_settings)
     , observers(observers) {
@@ -35,6 +57,9 @@ DsoSystem::DsoSystem(CameraModel *cam, const Observers &observers,
 
   for (DsoObserver *obs : observers.dso)
     obs->created(this, cam, settings);
+
+  if (settings.backgroundMapping)
+    mappingThread = std::thread(&DsoSystem::mappingLoop, this);
 }
 
 DsoSystem::DsoSystem(const SnapshotLoader &snapshotLoader,
@@ -45,8 +70,15 @@ DsoSystem::DsoSystem(const SnapshotLoader &snapshotLoader,
     , camPyr(cam->camPyr(_settings.pyramid.levelNum))
     , pixelSelector(_settings.pixelSelector)
     , isInitialized(true)
+    , trackingBase(nullptr)
+    , lastKeyFrameNum(-1)
+    , newTrackingBase(nullptr)
+    , bundleAdjuster(createBundleAdjuster(cam, _settings))
     , worldToFrame(_settings.initialMaxFrame)
     , worldToFramePredict(_settings.initialMaxFrame)
+    , pendingKeyFrames(0)
+    , isMapping(false)
+    , stopMapping(false)
     , lastTrackRmse(INF)
     , settings(_settings)
     , observers(observers) {
@@ -61,6 +93,7 @@ DsoSystem::DsoSystem(const SnapshotLoader &snapshotLoader,
   CHECK_GE(keyFrames.size(), 2);
 
   for (auto &[keyFrameNum, keyFrame] : keyFrames) {
+    bundleAdjuster->addKeyFrame(&keyFrame);
     frameNumbers.push_back(keyFrameNum);
     adjustWorldToFrameSizes(keyFrameNum);
     worldToFramePredict[keyFrameNum] = worldToFrame[keyFrameNum] =
@@ -101,15 +134,30 @@ DsoSystem::DsoSystem(const SnapshotLoader &snapshotLoader,
   }
 
   std::unique_ptr<DepthedImagePyramid> baseForTrack(new DepthedImagePyramid(
-      baseKeyFrame().preKeyFrame->frame(), settings.pyramid.levelNum, points,
+      baseKeyFrame().preKeyFrame->framePyr, settings.pyramid.levelNum, points,
       depths, weights));
 
   frameTracker = std::unique_ptr<FrameTracker>(
       new FrameTracker(camPyr, std::move(baseForTrack), observers.frameTracker,
                        settings.getFrameTrackerSettings()));
+  trackingBase = &baseKeyFrame();
+  trackingBaseToWorld = trackingBase->thisToWorld;
+  lastKeyFrameNum = lastKeyFrame().preKeyFrame->globalFrameNum;
+
+  if (settings.backgroundMapping)
+    mappingThread = std::thread(&DsoSystem::mappingLoop, this);
 }
 
 DsoSystem::~DsoSystem() {
+  if (mappingThread.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(mappingMutex);
+      stopMapping = true;
+    }
+    mappingCondition.notify_all();
+    mappingThread.join();
+  }
+
   std::vector<const KeyFrame *> lastKeyFrames;
   lastKeyFrames.reserve(keyFrames.size());
   for (const auto &kfp : keyFrames)
@@ -119,40 +167,46 @@ DsoSystem::~DsoSystem() {
 }
 
 template <typename PointT>
-EIGEN_STRONG_INLINE auto &getPoints(const KeyFrame &keyFrame);
+EIGEN_STRONG_INLINE auto &getPoints(KeyFrame &keyFrame);
 
 template <>
-EIGEN_STRONG_INLINE auto &getPoints<ImmaturePoint>(const KeyFrame &keyFrame) {
+EIGEN_STRONG_INLINE auto &getPoints<ImmaturePoint>(KeyFrame &keyFrame) {
   return keyFrame.immaturePoints;
 }
 
 template <>
-EIGEN_STRONG_INLINE auto &getPoints<OptimizedPoint>(const KeyFrame &keyFrame) {
+EIGEN_STRONG_INLINE auto &getPoints<OptimizedPoint>(KeyFrame &keyFrame) {
   return keyFrame.optimizedPoints;
 }
 
-template <typename PtrPointT>
-EIGEN_STRONG_INLINE double depth(const PtrPointT &p);
+// immature points are stored by value, optimized ones by pointer
+template <typename PointT>
+EIGEN_STRONG_INLINE PointT *pointPtr(std::unique_ptr<PointT> &p) {
+  return p.get();
+}
 
-template <>
-EIGEN_STRONG_INLINE double
-depth<std::unique_ptr<ImmaturePoint>>(const std::unique_ptr<ImmaturePoint> &p) {
-  return p->depth;
+template <typename PointT> EIGEN_STRONG_INLINE PointT *pointPtr(PointT &p) {
+  return &p;
 }
 
-template <>
-EIGEN_STRONG_INLINE double depth<std::unique_ptr<OptimizedPoint>>(
-    const std::unique_ptr<OptimizedPoint> &p) {
+EIGEN_STRONG_INLINE double depth(const ImmaturePoint *p) { return p->depth; }
+
+EIGEN_STRONG_INLINE double depth(const OptimizedPoint *p) {
   return p->depth();
 }
 
-// returns reprojection + depth
-std::pair<Vec2, double> reproject(CameraModel *cam, const SE3 origToReprojected,
-                                  const Vec2 &p, double depth) {
-  Vec3 reprojectedDir =
-      origToReprojected * (depth * cam->unmap(p).normalized());
-  Vec2 reprojectedPos = cam->map(reprojectedDir);
-  return {reprojectedPos, reprojectedDir.norm()};
+// reprojects a whole point set with one batched projection
+StdVector<Vec2> reproject(CameraModel *cam, const SE3 &origToReprojected,
+                          const StdVector<Vec2> &points,
+                          const std::vector<double> &depths) {
+  StdVector<Vec3> reprojectedDirs;
+  reprojectedDirs.reserve(points.size());
+  for (int i = 0; i < points.size(); ++i)
+    reprojectedDirs.push_back(origToReprojected *
+                              (depths[i] * cam->unmapUnit(points[i])));
+  StdVector<Vec2> reprojected;
+  cam->mapBatch(reprojectedDirs, reprojected);
+  return reprojected;
 }
 
 template <typename PointT>
@@ -173,30 +227,42 @@ void DsoSystem::projectOntoBaseKf(StdVector<Vec2> *points,
   for (auto &[num, kf] : keyFrames) {
     auto &curPoints = getPoints<PointT>(kf);
     if (&kf == baseKf) {
-      for (auto &p : curPoints)
+      for (auto &stored : curPoints) {
+        PointT *p = pointPtr(stored);
         if (p->state == PointT::ACTIVE) {
           if (points)
             points->push_back(p->p);
           if (depths)
             depths->push_back(depth(p));
           if (ptrs)
-            ptrs->push_back(p.get());
+            ptrs->push_back(p);
           if (kfs)
             kfs->push_back(baseKf);
         }
+      }
     } else {
       SE3 curToBase = baseKf->thisToWorld.inverse() * kf.thisToWorld;
-      for (auto &p : curPoints) {
-        Vec3 baseDir = curToBase * (depth(p) * cam->unmap(p->p).normalized());
-        Vec2 basePos = cam->map(baseDir);
-        if (!cam->isOnImage(basePos, 0))
+      std::vector<PointT *> curPtrs;
+      StdVector<Vec3> baseDirs;
+      curPtrs.reserve(curPoints.size());
+      baseDirs.reserve(curPoints.size());
+      for (auto &stored : curPoints) {
+        PointT *p = pointPtr(stored);
+        curPtrs.push_back(p);
+        baseDirs.push_back(curToBase * (depth(p) * cam->unmapUnit(p->p)));
+      }
+
+      StdVector<Vec2> basePos;
+      cam->mapBatch(baseDirs, basePos);
+      for (int i = 0; i < curPtrs.size(); ++i) {
+        if (!cam->isOnImage(basePos[i], 0))
           continue;
         if (points)
-          points->push_back(basePos);
+          points->push_back(basePos[i]);
         if (depths)
-          depths->push_back(baseDir.norm());
+          depths->push_back(baseDirs[i].norm());
         if (ptrs)
-          ptrs->push_back(p.get());
+          ptrs->push_back(curPtrs[i]);
         if (kfs)
           kfs->push_back(&kf);
       }
@@ -249,25 +315,24 @@ SE3 DsoSystem::predictBaseKfToCur() {
   double timeLastByLbo = getTimeLastByLbo();
 
   SE3 baseToLbo = worldToFrame[frameNumbers[frameNumbers.size() - 3]] *
-                  baseKeyFrame().thisToWorld;
+                  trackingBaseToWorld;
   SE3 baseToLast = worldToFrame[frameNumbers[frameNumbers.size() - 2]] *
-                   baseKeyFrame().thisToWorld;
+                   trackingBaseToWorld;
 
   return predictInternal(timeLastByLbo, baseToLbo, baseToLast);
 }
 
 SE3 DsoSystem::purePredictBaseKfToCur() {
   SE3 baseToLbo = worldToFramePredict[frameNumbers[frameNumbers.size() - 3]] *
-                  baseKeyFrame().thisToWorld;
+                  trackingBaseToWorld;
   SE3 baseToLast = worldToFramePredict[frameNumbers[frameNumbers.size() - 2]] *
-                   baseKeyFrame().thisToWorld;
+                   trackingBaseToWorld;
 
   return predictInternal(getTimeLastByLbo(), baseToLbo, baseToLast);
 }
 
 bool DsoSystem::doNeedKf(PreKeyFrame *lastFrame) {
-  int shift =
-      lastFrame->globalFrameNum - lastKeyFrame().preKeyFrame->globalFrameNum;
+  int shift = lastFrame->globalFrameNum - lastKeyFrameNum;
   return shift > 0 && shift % settings.shiftBetweenKeyFrames == 0;
 }
 
@@ -288,8 +353,10 @@ void DsoSystem::marginalizeFrames() {
     for (DsoObserver *obs : observers.dso)
       obs->keyFramesMarginalized(marginalized);
 
-    for (int i = 0; i < count; ++i)
+    for (int i = 0; i < count; ++i) {
+      bundleAdjuster->marginalizeKeyFrame(&keyFrames.begin()->second);
       keyFrames.erase(keyFrames.begin());
+    }
   }
 }
 
@@ -297,13 +364,16 @@ void DsoSystem::activateNewOptimizedPoints() {
   StdVector<Vec2> optPoints;
   for (const auto &[num, kf] : keyFrames) {
     SE3 refToBase = baseKeyFrame().thisToWorld.inverse() * kf.thisToWorld;
+    StdVector<Vec2> kfPoints;
+    std::vector<double> kfDepths;
     for (const auto &op : kf.optimizedPoints)
       if (op->state == OptimizedPoint::ACTIVE) {
-        auto [p, depth] = (&kf == &baseKeyFrame()
-                               ? std::pair(op->p, op->depth())
-                               : reproject(cam, refToBase, op->p, op->depth()));
-        optPoints.push_back(p);
+        kfPoints.push_back(op->p);
+        kfDepths.push_back(op->depth());
       }
+    if (&kf != &baseKeyFrame())
+      kfPoints = reproject(cam, refToBase, kfPoints, kfDepths);
+    optPoints.insert(optPoints.end(), kfPoints.begin(), kfPoints.end());
   }
 
   DistanceMap distMap(cam->getWidth(), cam->getHeight(), optPoints);
@@ -313,16 +383,20 @@ void DsoSystem::activateNewOptimizedPoints() {
 
   for (auto &[num, kf] : keyFrames) {
     SE3 refToBase = baseKeyFrame().thisToWorld.inverse() * kf.thisToWorld;
+    StdVector<Vec2> kfPoints;
+    std::vector<double> kfDepths;
     for (int ind = 0; ind < kf.immaturePoints.size(); ++ind) {
-      const auto &ip = kf.immaturePoints[ind];
-      if (ip->isReady()) {
-        auto [p, depth] = (&kf == &baseKeyFrame()
-                               ? std::pair(ip->p, ip->depth)
-                               : reproject(cam, refToBase, ip->p, ip->depth));
-        projectedImmatures.push_back(p);
+      auto &ip = kf.immaturePoints[ind];
+      if (ip.isReady()) {
+        kfPoints.push_back(ip.p);
+        kfDepths.push_back(ip.depth);
         immaturePositions.push_back({&kf, ind});
       }
     }
+    if (&kf != &baseKeyFrame())
+      kfPoints = reproject(cam, refToBase, kfPoints, kfDepths);
+    projectedImmatures.insert(projectedImmatures.end(), kfPoints.begin(),
+                              kfPoints.end());
   }
 
   LOG(INFO) << "\n\nPOINT SELECTION\n"
@@ -351,7 +425,7 @@ void DsoSystem::activateNewOptimizedPoints() {
     KeyFrame *kf = immaturePositions[i].first;
     auto &ip = kf->immaturePoints[immaturePositions[i].second];
     kf->optimizedPoints.push_back(
-        std::unique_ptr<OptimizedPoint>(new OptimizedPoint(*ip)));
+        std::unique_ptr<OptimizedPoint>(new OptimizedPoint(ip)));
 
     std::swap(ip, kf->immaturePoints.back());
     kf->immaturePoints.pop_back();
@@ -364,10 +438,34 @@ bool DsoSystem::didTrackFail() {
 }
 
 std::pair<SE3, AffineLightTransform<double>>
-DsoSystem::recoverTrack(PreKeyFrame *lastFrame) {
-  // TODO
-  typedef std::pair<SE3, AffineLightTransform<double>> retT;
-  return retT();
+DsoSystem::recoverTrack(
+    PreKeyFrame *lastFrame,
+    const std::pair<SE3, AffineLightTransform<double>> &firstAttempt) {
+  SE3 predicted, baseToPrev;
+  {
+    std::lock_guard<std::mutex> lock(posesMutex);
+    predicted = predictBaseKfToCur();
+    baseToPrev = worldToFrame[frameNumbers[frameNumbers.size() - 2]] *
+                 trackingBaseToWorld;
+  }
+
+  StdVector<SE3> hypotheses;
+  hypotheses.push_back(predicted);
+  hypotheses.push_back(baseToPrev);
+  double angle = settings.frameTracker.recoveryRotationAngle;
+  for (int dx = -1; dx <= 1; ++dx)
+    for (int dy = -1; dy <= 1; ++dy)
+      for (int dz = -1; dz <= 1; ++dz)
+        if (dx != 0 || dy != 0 || dz != 0) {
+          Vec3 axis = Vec3(dx, dy, dz).normalized();
+          hypotheses.push_back(SE3(SO3::exp(angle * axis), Vec3::Zero()) *
+                               predicted);
+        }
+
+  int minPyrLevel = std::min(settings.frameTracker.recoveryMinPyrLevel,
+                             settings.pyramid.levelNum - 1);
+  return frameTracker->recoverTrack(*lastFrame, hypotheses, lightKfToLast,
+                                    minPyrLevel, firstAttempt);
 }
 
 void DsoSystem::adjustWorldToFrameSizes(int newFrameNum) {
@@ -382,7 +480,10 @@ std::shared_ptr<PreKeyFrame> DsoSystem::addFrame(const cv::Mat &frame,
                                                  int globalFrameNum) {
   LOG(INFO) << "add frame #" << globalFrameNum << std::endl;
 
-  adjustWorldToFrameSizes(globalFrameNum);
+  {
+    std::lock_guard<std::mutex> lock(posesMutex);
+    adjustWorldToFrameSizes(globalFrameNum);
+  }
   CHECK(frameNumbers.empty() || globalFrameNum > frameNumbers.back());
   frameNumbers.push_back(globalFrameNum);
 
@@ -401,6 +502,8 @@ std::shared_ptr<PreKeyFrame> DsoSystem::addFrame(const cv::Mat &frame,
         int num = keyFrame.preKeyFrame->globalFrameNum;
         keyFrames.insert(std::pair<int, KeyFrame>(num, std::move(keyFrame)));
       }
+      for (auto &[num, keyFrame] : keyFrames)
+        bundleAdjuster->addKeyFrame(&keyFrame);
 
       std::vector<const KeyFrame *> initializedKFs;
       initializedKFs.reserve(keyFrames.size());
@@ -425,12 +528,15 @@ std::shared_ptr<PreKeyFrame> DsoSystem::addFrame(const cv::Mat &frame,
       std::vector<double> weights(points.size(), 1.0);
 
       std::unique_ptr<DepthedImagePyramid> initialTrack(new DepthedImagePyramid(
-          baseKeyFrame().preKeyFrame->frame(), settings.pyramid.levelNum,
+          baseKeyFrame().preKeyFrame->framePyr, settings.pyramid.levelNum,
           points, depths, weights));
 
       frameTracker = std::unique_ptr<FrameTracker>(new FrameTracker(
           camPyr, std::move(initialTrack), observers.frameTracker,
           settings.getFrameTrackerSettings()));
+      trackingBase = &baseKeyFrame();
+      trackingBaseToWorld = trackingBase->thisToWorld;
+      lastKeyFrameNum = lastKeyFrame().preKeyFrame->globalFrameNum;
 
       lastInitialized = &keyFrames.rbegin()->second;
 
@@ -443,8 +549,10 @@ std::shared_ptr<PreKeyFrame> DsoSystem::addFrame(const cv::Mat &frame,
     return nullptr;
   }
 
+  takeNewFrameTracker();
+
   std::shared_ptr<PreKeyFrame> preKeyFrame(
-      new PreKeyFrame(&baseKeyFrame(), cam, frame, globalFrameNum));
+      new PreKeyFrame(trackingBase, cam, frame, globalFrameNum));
 
   for (DsoObserver *obs : observers.dso)
     obs->newFrame(preKeyFrame.get());
@@ -452,22 +560,43 @@ std::shared_ptr<PreKeyFrame> DsoSystem::addFrame(const cv::Mat &frame,
   SE3 baseKfToCur;
   AffineLightTransform<double> lightBaseKfToCur;
 
-  SE3 purePredicted = purePredictBaseKfToCur();
-  SE3 predicted = predictBaseKfToCur();
+  SE3 purePredicted, predicted;
+  {
+    std::lock_guard<std::mutex> lock(posesMutex);
+    purePredicted = purePredictBaseKfToCur();
+    predicted = predictBaseKfToCur();
+  }
 
   std::tie(baseKfToCur, lightBaseKfToCur) =
       frameTracker->trackFrame(*preKeyFrame, predicted, lightKfToLast);
 
+  if (didTrackFail()) {
+    LOG(WARNING) << "tracking failed on frame #" << globalFrameNum
+                 << ": RMSE = " << frameTracker->lastRmse
+                 << ", last RMSE = " << lastTrackRmse << std::endl;
+    std::tie(baseKfToCur, lightBaseKfToCur) = recoverTrack(
+        preKeyFrame.get(), {baseKfToCur, lightBaseKfToCur});
+  }
+  // a failed frame must not raise the threshold for the next ones
+  if (didTrackFail())
+    LOG(WARNING) << "track recovery failed on frame #" << globalFrameNum
+                 << ", RMSE = " << frameTracker->lastRmse
+                 << ", keeping last RMSE = " << lastTrackRmse << std::endl;
+  else
+    lastTrackRmse = frameTracker->lastRmse;
+
   preKeyFrame->lightBaseToThis = lightBaseKfToCur;
 
   LOG(INFO) << "aff light (base to cur): (fnum=" << preKeyFrame->globalFrameNum
             << ")\n"
             << preKeyFrame->lightBaseToThis << std::endl;
 
-  worldToFrame[globalFrameNum] =
-      baseKfToCur * baseKeyFrame().thisToWorld.inverse();
-  worldToFramePredict[globalFrameNum] =
-      purePredicted * baseKeyFrame().thisToWorld.inverse();
+  {
+    std::lock_guard<std::mutex> lock(posesMutex);
+    worldToFrame[globalFrameNum] = baseKfToCur * trackingBaseToWorld.inverse();
+    worldToFramePredict[globalFrameNum] =
+        purePredicted * trackingBaseToWorld.inverse();
+  }
 
   preKeyFrame->baseToThis = baseKfToCur;
 
@@ -478,23 +607,104 @@ std::shared_ptr<PreKeyFrame> DsoSystem::addFrame(const cv::Mat &frame,
             << diff.translation().norm() << " " << diff.so3().log().norm()
             << '\n';
 
+  bool needNewKf = doNeedKf(preKeyFrame.get());
+  if (settings.continueChoosingKeyFrames && needNewKf)
+    lastKeyFrameNum = globalFrameNum;
+
+  if (!settings.backgroundMapping) {
+    mapFrame(preKeyFrame, needNewKf);
+    return preKeyFrame;
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(mappingMutex);
+    // At most one keyframe is in flight, so that the frames in the queue never
+    // outlive the keyframes they were tracked against.
+    if (needNewKf)
+      mappingCondition.wait(lock, [this]() { return pendingKeyFrames == 0; });
+    mappingQueue.push_back({preKeyFrame, needNewKf});
+    if (needNewKf)
+      pendingKeyFrames++;
+  }
+  mappingCondition.notify_all();
+
+  return preKeyFrame;
+}
+
+void DsoSystem::mapFrame(const std::shared_ptr<PreKeyFrame> &preKeyFrame,
+                         bool needNewKf) {
   int totalTraced = 0, totalGood = 0;
   constexpr int maxTraced = 8;
   std::vector<int> numTraced(maxTraced, 0);
   std::vector<int> numOnLevel(settings.pyramid.levelNum, 0);
-  for (const auto &[num, kf] : keyFrames)
+
+  // Points that cannot improve are not traced at all. If there are more
+  // candidates than maxTracedPoints, the ones with the largest expected gain
+  // go first: never traced points, newest keyframes first, then the ones with
+  // the largest stddev times the parallax between their keyframe and this
+  // frame.
+  std::vector<std::pair<const KeyFrame *, ImmaturePoint *>> toTrace;
+  std::vector<std::pair<double, int>> priorities;
+  const SE3 worldToRef = preKeyFrame->baseToThis *
+                         preKeyFrame->baseKeyFrame->thisToWorld.inverse();
+  for (auto &[num, kf] : keyFrames) {
+    double baseline = (worldToRef * kf.thisToWorld).translation().norm();
     for (auto &ip : kf.immaturePoints) {
-      auto status = ip->traceOn(kf, *preKeyFrame, ImmaturePoint::NO_DEBUG);
+      if (!ip.canImprove())
+        continue;
+      double priority =
+          ip.numTraced == 0 ? INF : ip.stddev * baseline / ip.depth;
+      priorities.push_back({priority, kf.preKeyFrame->globalFrameNum});
+      toTrace.push_back({&kf, &ip});
+    }
+  }
 
-      if (status == ImmaturePoint::OK)
-        totalTraced++;
-      if (ip->isReady())
+  const int budget = settings.pointTracer.maxTracedPoints;
+  if (budget > 0 && toTrace.size() > budget) {
+    std::vector<int> order(toTrace.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::nth_element(
+        order.begin(), order.begin() + budget, order.end(),
+        [&](int a, int b) { return priorities[a] > priorities[b]; });
+    order.resize(budget);
+    std::sort(order.begin(), order.end());
+    for (int i = 0; i < budget; ++i)
+      toTrace[i] = toTrace[order[i]];
+    toTrace.resize(budget);
+  }
+  LOG(INFO) << "points to trace = " << toTrace.size();
+
+  // Each traceOn changes only its own point, so points are traced in
+  // parallel. Statistics are gathered afterwards, so they do not depend on
+  // the scheduling.
+  std::vector<ImmaturePoint::TracingStatus> statuses(toTrace.size());
+
+  tbb::task_arena arena(settings.threading.numThreads);
+  tracingContexts.resize(arena.max_concurrency());
+  arena.execute([&]() {
+    tbb::parallel_for(
+        tbb::blocked_range<int>(0, toTrace.size()),
+        [&](const tbb::blocked_range<int> &range) {
+          ImmaturePoint::TracingContext &context =
+              tracingContexts[tbb::this_task_arena::current_thread_index()];
+          for (int i = range.begin(); i != range.end(); ++i)
+            statuses[i] = toTrace[i].second->traceOn(
+                *toTrace[i].first, *preKeyFrame, ImmaturePoint::NO_DEBUG,
+                context);
+        });
+  });
+
+  totalTraced = std::count(statuses.begin(), statuses.end(),
+                           ImmaturePoint::OK);
+  for (auto &[num, kf] : keyFrames)
+    for (auto &ip : kf.immaturePoints) {
+      if (ip.isReady())
         totalGood++;
 
-      if (ip->numTraced < maxTraced)
-        numTraced[ip->numTraced]++;
-      if (ip->tracedPyrLevel >= 0)
-        numOnLevel[ip->tracedPyrLevel]++;
+      if (ip.numTraced < maxTraced)
+        numTraced[ip.numTraced]++;
+      if (ip.tracedPyrLevel >= 0)
+        numOnLevel[ip.tracedPyrLevel]++;
     }
 
   LOG(INFO) << "POINT TRACING:";
@@ -508,15 +718,15 @@ std::shared_ptr<PreKeyFrame> DsoSystem::addFrame(const cv::Mat &frame,
   // for (DsoObserver *obs : observers.dso)
   // obs->pointsTraced ... ;
 
-  bool needNewKf = doNeedKf(preKeyFrame.get());
   if (!needNewKf)
-    baseKeyFrame().trackedFrames.push_back(preKeyFrame);
+    preKeyFrame->baseKeyFrame->trackedFrames.push_back(preKeyFrame);
 
   if (settings.continueChoosingKeyFrames && needNewKf) {
     int kfNum = preKeyFrame->globalFrameNum;
     keyFrames.insert(std::pair<int, KeyFrame>(
         kfNum, KeyFrame(preKeyFrame, pixelSelector, settings.keyFrame,
                         settings.getPointTracerSettings())));
+    bundleAdjuster->addKeyFrame(&keyFrames.at(kfNum));
 
     marginalizeFrames();
     activateNewOptimizedPoints();
@@ -525,12 +735,9 @@ std::shared_ptr<PreKeyFrame> DsoSystem::addFrame(const cv::Mat &frame,
       obs->newKeyFrame(&baseKeyFrame());
 
     if (settings.bundleAdjuster.runBA) {
-      BundleAdjuster bundleAdjuster(cam, settings.getBundleAdjusterSettings());
-
-      for (auto &[num, kf] : keyFrames)
-        bundleAdjuster.addKeyFrame(&kf);
-      bundleAdjuster.adjust(settings.bundleAdjuster.maxIterations);
+      bundleAdjuster->adjust(settings.bundleAdjuster.maxIterations);
 
+      std::lock_guard<std::mutex> lock(posesMutex);
       for (const auto &[num, kf] : keyFrames) {
         SE3 worldToKf = kf.thisToWorld.inverse();
         worldToFrame[kf.preKeyFrame->globalFrameNum] = worldToKf;
@@ -539,37 +746,79 @@ std::shared_ptr<PreKeyFrame> DsoSystem::addFrame(const cv::Mat &frame,
       }
     }
 
-    StdVector<Vec2> points;
-    std::vector<double> depths;
-    std::vector<OptimizedPoint *> refs;
-    projectOntoBaseKf<OptimizedPoint>(&points, &depths, &refs, nullptr);
-    std::vector<double> weights(points.size());
-    for (int i = 0; i < points.size(); ++i)
-      weights[i] = 1.0 / refs[i]->stddev;
-    std::unique_ptr<DepthedImagePyramid> baseForTrack(new DepthedImagePyramid(
-        baseKeyFrame().preKeyFrame->frame(), settings.pyramid.levelNum, points,
-        depths, weights));
-
-    // for (int i = 0; i < points.size(); ++i) {
-    // for (int pl = 0; pl < settings.pyramid.levelNum; ++pl) {
-    // cv::Point p = toCvPoint(points[i]);
-    // if (baseForTrack->depths[pl](p / (1 << pl)) <= 0) {
-    // std::cout << "pl=" << pl << " p=" << p << " psh=" << p / (1 << pl)
-    // << " i=" << i << " d=" << depths[i] << " w=" << weights[i]
-    // << " porig=" << points[i] << std::endl;
-    // }
-    // }
-    // }
-
-    frameTracker = std::unique_ptr<FrameTracker>(new FrameTracker(
-        camPyr, std::move(baseForTrack), observers.frameTracker,
-        settings.getFrameTrackerSettings()));
+    publishFrameTracker();
   }
+}
 
-  return preKeyFrame;
+void DsoSystem::publishFrameTracker() {
+  StdVector<Vec2> points;
+  std::vector<double> depths;
+  std::vector<OptimizedPoint *> refs;
+  projectOntoBaseKf<OptimizedPoint>(&points, &depths, &refs, nullptr);
+  std::vector<double> weights(points.size());
+  for (int i = 0; i < points.size(); ++i)
+    weights[i] = 1.0 / refs[i]->stddev;
+  std::unique_ptr<DepthedImagePyramid> baseForTrack(new DepthedImagePyramid(
+      baseKeyFrame().preKeyFrame->framePyr, settings.pyramid.levelNum, points,
+      depths, weights));
+
+  std::unique_ptr<FrameTracker> tracker(
+      new FrameTracker(camPyr, std::move(baseForTrack), observers.frameTracker,
+                       settings.getFrameTrackerSettings()));
+
+  // double buffering: tracking picks the new tracker up on the next frame
+  std::lock_guard<std::mutex> lock(mappingMutex);
+  newFrameTracker = std::move(tracker);
+  newTrackingBase = &baseKeyFrame();
+  newTrackingBaseToWorld = baseKeyFrame().thisToWorld;
 }
 
-void DsoSystem::saveSnapshot(const std::string &snapshotDir) const {
+void DsoSystem::takeNewFrameTracker() {
+  std::lock_guard<std::mutex> lock(mappingMutex);
+  if (!newFrameTracker)
+    return;
+  frameTracker = std::move(newFrameTracker);
+  trackingBase = newTrackingBase;
+  trackingBaseToWorld = newTrackingBaseToWorld;
+  // RMSE against the old base is not comparable to the new one
+  lastTrackRmse = INF;
+}
+
+void DsoSystem::mappingLoop() {
+  while (true) {
+    MappingTask task;
+    {
+      std::unique_lock<std::mutex> lock(mappingMutex);
+      mappingCondition.wait(
+          lock, [this]() { return stopMapping || !mappingQueue.empty(); });
+      if (mappingQueue.empty())
+        return;
+      task = std::move(mappingQueue.front());
+      mappingQueue.pop_front();
+      isMapping = true;
+    }
+
+    mapFrame(task.frame, task.needNewKf);
+
+    {
+      std::lock_guard<std::mutex> lock(mappingMutex);
+      isMapping = false;
+      if (task.needNewKf)
+        pendingKeyFrames--;
+    }
+    mappingCondition.notify_all();
+  }
+}
+
+void DsoSystem::waitForMapping() {
+  std::unique_lock<std::mutex> lock(mappingMutex);
+  mappingCondition.wait(
+      lock, [this]() { return mappingQueue.empty() && !isMapping; });
+}
+
+void DsoSystem::saveSnapshot(const std::string &snapshotDir) {
+  waitForMapping();
+
   SnapshotSaver snapshotSaver(snapshotDir,
                               settings.residualPattern.pattern().size());
   std::vector<const KeyFrame *> keyFramePtrs;
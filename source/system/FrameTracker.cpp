@@ -1,12 +1,17 @@
 #include "system/FrameTracker.h"
 #include "PreKeyFrameInternals.h"
+#include "TrackingEnergy.h"
 #include "output/FrameTrackerObserver.h"
 #include "util/defs.h"
 #include "util/util.h"
+#include <algorithm>
 #include <ceres/cubic_interpolation.h>
 #include <ceres/problem.h>
 #include <chrono>
 #include <cmath>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/task_arena.h>
 
 namespace fishdso {
 
@@ -65,10 +70,55 @@ FrameTracker::FrameTracker(const StdVector<CameraModel> &camPyr,
     , displayHeight(camPyr[1].getHeight())
     , observers(observers)
     , settings(_settings) {
+  basePoints.reserve(settings.pyramid.levelNum);
+  for (int pl = 0; pl < settings.pyramid.levelNum; ++pl)
+    basePoints.push_back(collectPoints(camPyr[pl], baseFrame->images[pl],
+                                       baseFrame->depthedPixels[pl]));
+
   for (FrameTrackerObserver *obs : observers)
     obs->newBaseFrame(*baseFrame);
 }
 
+FrameTracker::TrackingPoints FrameTracker::collectPoints(
+    const CameraModel &cam, const cv::Mat1b &baseImg,
+    const std::vector<DepthedImagePyramid::DepthedPixel> &basePixels) const {
+  TrackingPoints points;
+  double c = settings.gradWeighting.c;
+
+  for (const auto &dp : basePixels) {
+    if (dp.depth <= 0)
+      continue;
+    double weight = 1.0;
+    if (settings.frameTracker.useGradWeighting) {
+      double gradNorm = gradNormAt(baseImg, dp.pixel);
+      weight = c / std::hypot(c, gradNorm);
+    }
+
+    Vec2 p = toVec2(dp.pixel);
+    points.positions.push_back(cam.unmapUnit(p) * dp.depth);
+    points.pixels.push_back(p);
+    points.intencities.push_back(static_cast<double>(baseImg(dp.pixel)));
+    points.weights.push_back(weight);
+  }
+
+  return points;
+}
+
+void FrameTracker::TrackingPoints::clear() {
+  positions.clear();
+  pixels.clear();
+  intencities.clear();
+  weights.clear();
+}
+
+void FrameTracker::TrackingPoints::push_back(const TrackingPoints &other,
+                                             int i) {
+  positions.push_back(other.positions[i]);
+  pixels.push_back(other.pixels[i]);
+  intencities.push_back(other.intencities[i]);
+  weights.push_back(other.weights[i]);
+}
+
 void FrameTracker::addObserver(FrameTrackerObserver *observer) {
   observers.push_back(observer);
 }
@@ -83,11 +133,15 @@ FrameTracker::trackFrame(const PreKeyFrame &frame,
   SE3 baseToTracked = coarseBaseToTracked;
   AffineLightTransform<double> affLight = coarseAffLight;
 
+  StdVector<std::pair<Vec2, double>> pointResiduals;
   for (int i = settings.pyramid.levelNum - 1; i >= 0; --i) {
     LOG(INFO) << "track level #" << i << std::endl;
     std::tie(baseToTracked, affLight) = trackPyrLevel(
-        camPyr[i], baseFrame->images[i], baseFrame->depths[i],
-        frame.framePyr.images[i], *frame.internals, baseToTracked, affLight, i);
+        camPyr[i], basePoints[i], *frame.internals, baseToTracked, affLight, i,
+        trackablePoints, &pointResiduals, &lastRmse, nullptr);
+
+    for (FrameTrackerObserver *obs : observers)
+      obs->levelTracked(i, baseToTracked, affLight, pointResiduals);
   }
 
   // cv::waitKey();
@@ -95,24 +149,135 @@ FrameTracker::trackFrame(const PreKeyFrame &frame,
   return {baseToTracked, affLight};
 }
 
-bool isPointTrackable(const CameraModel &cam, const Vec3 &basePos,
-                      const SE3 &coarseBaseToCur) {
-  Vec3 coarseCurPos = coarseBaseToCur * basePos;
-  Vec2 coarseCurOnImg = cam.map(coarseCurPos);
-  return cam.isOnImage(coarseCurOnImg, 0);
+std::pair<SE3, AffineLightTransform<double>> FrameTracker::trackFrameCoarse(
+    const PreKeyFrame &frame, const SE3 &coarseBaseToTracked,
+    const AffineLightTransform<double> &coarseAffLight, int minPyrLevel,
+    double *energy) const {
+  CHECK(minPyrLevel >= 0 && minPyrLevel < settings.pyramid.levelNum);
+
+  SE3 baseToTracked = coarseBaseToTracked;
+  AffineLightTransform<double> affLight = coarseAffLight;
+
+  TrackingPoints points;
+  for (int i = settings.pyramid.levelNum - 1; i >= minPyrLevel; --i)
+    std::tie(baseToTracked, affLight) =
+        trackPyrLevel(camPyr[i], basePoints[i], *frame.internals,
+                      baseToTracked, affLight, i, points, nullptr, nullptr,
+                      i == minPyrLevel ? energy : nullptr);
+
+  return {baseToTracked, affLight};
+}
+
+std::pair<SE3, AffineLightTransform<double>> FrameTracker::recoverTrack(
+    const PreKeyFrame &frame, const StdVector<SE3> &hypotheses,
+    const AffineLightTransform<double> &coarseAffLight, int minPyrLevel,
+    const std::pair<SE3, AffineLightTransform<double>> &firstAttempt) {
+  CHECK(!hypotheses.empty());
+  const double firstRmse = lastRmse;
+
+  StdVector<std::pair<SE3, AffineLightTransform<double>>> tracked(
+      hypotheses.size());
+  std::vector<double> energy(hypotheses.size(), INF);
+
+  tbb::task_arena arena(settings.threading.numThreads);
+  arena.execute([&]() {
+    tbb::parallel_for(tbb::blocked_range<int>(0, hypotheses.size()),
+                      [&](const tbb::blocked_range<int> &range) {
+                        for (int i = range.begin(); i != range.end(); ++i)
+                          tracked[i] = trackFrameCoarse(
+                              frame, hypotheses[i], coarseAffLight,
+                              minPyrLevel, &energy[i]);
+                      });
+  });
+
+  int best = std::min_element(energy.begin(), energy.end()) - energy.begin();
+  LOG(INFO) << "track recovery: best of " << hypotheses.size()
+            << " hypotheses is #" << best << " with coarse energy = "
+            << energy[best] << std::endl;
+
+  auto refined = trackFrame(frame, tracked[best].first, tracked[best].second);
+  if (lastRmse < firstRmse)
+    return refined;
+
+  LOG(INFO) << "track recovery: refined RMSE = " << lastRmse
+            << " is not lower than the first RMSE = " << firstRmse
+            << ", keeping the first attempt" << std::endl;
+  lastRmse = firstRmse;
+  return firstAttempt;
 }
 
 std::pair<SE3, AffineLightTransform<double>> FrameTracker::trackPyrLevel(
-    const CameraModel &cam, const cv::Mat1b &baseImg,
-    const cv::Mat1d &baseDepths, const cv::Mat1b &trackedImg,
+    const CameraModel &cam, const TrackingPoints &levelPoints,
     const PreKeyFrameInternals &internals, const SE3 &coarseBaseToTracked,
-    const AffineLightTransform<double> &coarseAffLight, int pyrLevel) {
+    const AffineLightTransform<double> &coarseAffLight, int pyrLevel,
+    TrackingPoints &points, StdVector<std::pair<Vec2, double>> *pointResiduals,
+    double *rmse, double *meanEnergy) const {
   SE3 baseToTracked = coarseBaseToTracked;
   AffineLightTransform<double> affLight = coarseAffLight;
 
-  cv::Size displSz = cv::Size(displayHeight, displayWidth);
-  cv::Mat1b resMask(baseImg.size(), CV_WHITE_BYTE);
+  // only the points visible under the coarse motion are tracked
+  StdVector<Vec3> &coarsePositions = points.coarsePositions;
+  StdVector<Vec2> &coarseOnImg = points.coarseOnImg;
+  coarsePositions.resize(levelPoints.positions.size());
+  for (int i = 0; i < levelPoints.positions.size(); ++i)
+    coarsePositions[i] = coarseBaseToTracked * levelPoints.positions[i];
+  cam.mapBatch(coarsePositions, coarseOnImg);
+
+  points.clear();
+  for (int i = 0; i < levelPoints.positions.size(); ++i)
+    if (cam.isOnImage(coarseOnImg[i], 0))
+      points.push_back(levelPoints, i);
+
+  if (settings.frameTracker.useCeres)
+    solveCeres(cam, points, internals, pyrLevel, baseToTracked, affLight);
+  else
+    solveGaussNewton(cam, points, internals, pyrLevel, baseToTracked,
+                     affLight);
+
+  if (pointResiduals) {
+    pointResiduals->clear();
+    pointResiduals->reserve(points.positions.size());
+  }
+
+  const double outlierDiff = settings.intencity.outlierDiff;
+  double sqSum = 0, huberSum = 0;
+  int onImage = 0;
+  internals.withInterpolator(
+      pyrLevel, settings.frameTracker.useBilinear, [&](const auto &tracked) {
+        for (int i = 0; i < points.positions.size(); ++i) {
+          Vec2 onTracked = cam.map(baseToTracked * points.positions[i]);
+          double trackedIntencity;
+          tracked.Evaluate(onTracked[1], onTracked[0], &trackedIntencity);
+          double eval = affLight(trackedIntencity) - points.intencities[i];
+          if (pointResiduals)
+            pointResiduals->push_back(std::pair(onTracked, eval));
+          if (cam.isOnImage(onTracked, 0)) {
+            double absEval = std::abs(eval);
+            sqSum += eval * eval;
+            huberSum += absEval <= outlierDiff
+                            ? 0.5 * eval * eval
+                            : outlierDiff * (absEval - 0.5 * outlierDiff);
+            ++onImage;
+          }
+        }
+      });
+  if (rmse)
+    *rmse = onImage > 0 ? std::sqrt(sqSum / onImage) : INF;
+  // the points lost under the coarse motion are outliers too
+  if (meanEnergy) {
+    int levelSize = levelPoints.positions.size();
+    double lostEnergy = 0.5 * outlierDiff * outlierDiff * (levelSize - onImage);
+    *meanEnergy = levelSize > 0 ? (huberSum + lostEnergy) / levelSize : INF;
+  }
 
+  return {baseToTracked, affLight};
+}
+
+void FrameTracker::solveCeres(const CameraModel &cam,
+                              const TrackingPoints &points,
+                              const PreKeyFrameInternals &internals,
+                              int pyrLevel, SE3 &baseToTracked,
+                              AffineLightTransform<double> &affLight) const {
   const ceres::BiCubicInterpolator<ceres::Grid2D<unsigned char, 1>>
       &trackedFrame = internals.interpolator(pyrLevel);
 
@@ -135,59 +300,28 @@ std::pair<SE3, AffineLightTransform<double>> FrameTracker::trackPyrLevel(
   if (!settings.affineLight.optimizeAffineLight)
     problem.SetParameterBlockConstant(affLight.data);
 
-  std::vector<double> pixUsed;
-
-  double pnt[2] = {0.0, 0.0};
-
-  std::vector<const PointTrackingResidual *> residuals;
-  StdVector<Vec2> gotOutside;
-
-  int pntTotal = 0;
-
-  for (int y = 0; y < baseImg.rows; ++y)
-    for (int x = 0; x < baseImg.cols; ++x)
-      if (baseDepths(y, x) > 0) {
-        if (!resMask(y, x))
-          continue;
-        ++pntTotal;
-        pnt[0] = x;
-        pnt[1] = y;
-
-        Vec3 pos = cam.unmap(pnt).normalized() * baseDepths(y, x);
-        if (!isPointTrackable(cam, pos, coarseBaseToTracked)) {
-          gotOutside.push_back(Vec2(x, y));
-          continue;
-        }
-
-        pixUsed.push_back(baseImg(y, x));
-
-        ceres::LossFunction *lossFunc = nullptr;
-        if (settings.frameTracker.useGradWeighting) {
-          double gradNorm = gradNormAt(baseImg, cv::Point(x, y));
-          double c = settings.gradWeighting.c;
-          double weight = c / std::hypot(c, gradNorm);
-          lossFunc = new ceres::ScaledLoss(
-              new ceres::HuberLoss(settings.intencity.outlierDiff), weight,
-              ceres::Ownership::TAKE_OWNERSHIP);
-        } else
-          lossFunc = new ceres::HuberLoss(settings.intencity.outlierDiff);
-
-        auto newResidual = new PointTrackingResidual(
-            pos, static_cast<double>(baseImg(y, x)), &cam, &trackedFrame);
-        residuals.push_back(newResidual);
-        ceres::CostFunction *newCostFunc =
-            new ceres::AutoDiffCostFunction<PointTrackingResidual, 1, 4, 3, 2>(
-                newResidual);
-        problem.AddResidualBlock(
-            newCostFunc, lossFunc, baseToTracked.so3().data(),
-            baseToTracked.translation().data(), affLight.data);
-      }
+  for (int i = 0; i < points.positions.size(); ++i) {
+    ceres::LossFunction *lossFunc = nullptr;
+    if (settings.frameTracker.useGradWeighting)
+      lossFunc = new ceres::ScaledLoss(
+          new ceres::HuberLoss(settings.intencity.outlierDiff),
+          points.weights[i], ceres::Ownership::TAKE_OWNERSHIP);
+    else
+      lossFunc = new ceres::HuberLoss(settings.intencity.outlierDiff);
+
+    ceres::CostFunction *newCostFunc =
+        new ceres::AutoDiffCostFunction<PointTrackingResidual, 1, 4, 3, 2>(
+            new PointTrackingResidual(points.positions[i],
+                                      points.intencities[i], &cam,
+                                      &trackedFrame));
+    problem.AddResidualBlock(newCostFunc, lossFunc,
+                             baseToTracked.so3().data(),
+                             baseToTracked.translation().data(), affLight.data);
+  }
 
   ceres::Solver::Options options;
   options.linear_solver_type = ceres::DENSE_QR;
   options.num_threads = settings.threading.numThreads;
-  // options.minimizer_progress_to_stdout = true;
-  // options.max_num_iterations = 10;
   ceres::Solver::Summary summary;
 
   ceres::Solve(options, &problem, &summary);
@@ -195,22 +329,82 @@ std::pair<SE3, AffineLightTransform<double>> FrameTracker::trackPyrLevel(
             << std::endl;
 
   LOG(INFO) << summary.BriefReport() << std::endl;
+}
 
-  StdVector<std::pair<Vec2, double>> pointResiduals;
-  pointResiduals.reserve(residuals.size());
-
-  for (auto res : residuals) {
-    double eval = -1;
-    (*res)(baseToTracked.unit_quaternion().coeffs().data(),
-           baseToTracked.translation().data(), affLight.data, &eval);
-    Vec2 onTracked = cam.map(baseToTracked * res->pos);
-    pointResiduals.push_back(std::pair(onTracked, eval));
+void FrameTracker::solveGaussNewton(
+    const CameraModel &cam, const TrackingPoints &points,
+    const PreKeyFrameInternals &internals, int pyrLevel, SE3 &baseToTracked,
+    AffineLightTransform<double> &affLight) const {
+  auto startTime = std::chrono::steady_clock::now();
+
+  const Settings::AffineLight &lightSettings = settings.affineLight;
+  const int optDim = lightSettings.optimizeAffineLight ? 8 : 6;
+
+  auto accumulate = [&](const SE3 &motion,
+                        const AffineLightTransform<double> &light, Mat88 *H,
+                        Vec8 *b) {
+    return internals.withInterpolator(
+        pyrLevel, settings.frameTracker.useBilinear, [&](const auto &tracked) {
+          return cam.withType([&](auto camType) {
+            return accumulateTracking<decltype(camType)::value>(
+                cam, tracked, points.positions, points.intencities,
+                points.weights, motion, light, settings.intencity.outlierDiff,
+                H, b);
+          });
+        });
+  };
+
+  Mat88 H;
+  Vec8 b;
+  double energy = accumulate(baseToTracked, affLight, &H, &b);
+  double initialEnergy = energy;
+
+  double lambda = settings.frameTracker.initialLambda;
+  int it = 0;
+  for (; it < settings.frameTracker.maxIterations; ++it) {
+    MatXX damped = H.topLeftCorner(optDim, optDim);
+    damped.diagonal() *= 1 + lambda;
+    VecX delta = -damped.ldlt().solve(b.head(optDim));
+    if (!delta.allFinite())
+      break;
+
+    SE3 newBaseToTracked = SE3::exp(delta.head<6>()) * baseToTracked;
+    AffineLightTransform<double> newAffLight = affLight;
+    if (lightSettings.optimizeAffineLight) {
+      newAffLight.data[0] = std::clamp(affLight.data[0] + delta[6],
+                                       lightSettings.minAffineLightA,
+                                       lightSettings.maxAffineLightA);
+      newAffLight.data[1] = std::clamp(affLight.data[1] + delta[7],
+                                       lightSettings.minAffineLightB,
+                                       lightSettings.maxAffineLightB);
+    }
+
+    // rejected steps cost one energy evaluation, the system is relinearized
+    // only at the accepted ones
+    double newEnergy = accumulate(newBaseToTracked, newAffLight, nullptr,
+                                  nullptr);
+
+    if (newEnergy < energy) {
+      baseToTracked = newBaseToTracked;
+      affLight = newAffLight;
+      energy = accumulate(baseToTracked, affLight, &H, &b);
+      lambda *= 0.5;
+    } else
+      lambda *= 4;
+
+    if (delta.norm() < settings.frameTracker.minStepNorm)
+      break;
   }
 
-  for (FrameTrackerObserver *obs : observers)
-    obs->levelTracked(pyrLevel, baseToTracked, affLight, pointResiduals);
-
-  return {baseToTracked, affLight};
+  auto endTime = std::chrono::steady_clock::now();
+  LOG(INFO) << "time (mcs) = "
+            << std::chrono::duration_cast<std::chrono::microseconds>(
+                   endTime - startTime)
+                   .count()
+            << std::endl;
+  LOG(INFO) << "GN iterations: " << it << ", energy: " << initialEnergy
+            << " -> " << energy << " on " << points.positions.size()
+            << " points" << std::endl;
 }
 
 } // namespace fishdso
@@ -10,18 +10,13 @@
 
 namespace fishdso {
 
-#define PL (settings.pyramid.levelNum)
-#define PS (settings.residualPattern.pattern().size())
-#define PH (settings.residualPattern.height)
-#define TH (settings.intencity.outlierDiff)
+#define PL (settings->pyramid.levelNum)
+#define PS (settings->residualPattern.pattern().size())
+#define PH (settings->residualPattern.height)
+#define TH (settings->intencity.outlierDiff)
 
-ImmaturePoint::ImmaturePoint(KeyFrame *baseFrame, const Vec2 &p,
-                             const PointTracerSettings &_settings)
+ImmaturePoint::ImmaturePoint(KeyFrame *baseFrame, const Vec2 &p)
     : p(p)
-    , baseDirections(_settings.residualPattern.pattern().size())
-    , baseIntencities(_settings.residualPattern.pattern().size())
-    , baseGrad(_settings.residualPattern.pattern().size())
-    , baseGradNorm(_settings.residualPattern.pattern().size())
     , minDepth(0)
     , maxDepth(INF)
     , bestQuality(-1)
@@ -29,7 +24,7 @@ ImmaturePoint::ImmaturePoint(KeyFrame *baseFrame, const Vec2 &p,
     , stddev(INF)
     , cam(baseFrame->preKeyFrame->cam)
     , state(ACTIVE)
-    , settings(_settings)
+    , settings(baseFrame->tracingSettings.get())
     , lastTraced(false)
     , numTraced(0)
     , tracedPyrLevel(0) {
@@ -39,26 +34,20 @@ ImmaturePoint::ImmaturePoint(KeyFrame *baseFrame, const Vec2 &p,
   }
 
   for (int i = 0; i < PS; ++i) {
-    Vec2 curP = p + settings.residualPattern.pattern()[i];
+    Vec2 curP = p + settings->residualPattern.pattern()[i];
     cv::Point curPCV = toCvPoint(curP);
-    baseDirections[i] = cam->unmap(curP).normalized();
+    baseDirections[i] = cam->unmapUnit(curP);
     baseIntencities[i] = baseFrame->preKeyFrame->frame()(curPCV);
 
-    baseGrad[i] = Vec2(baseFrame->preKeyFrame->gradX(curPCV),
-                       baseFrame->preKeyFrame->gradY(curPCV));
+    baseGrad[i] = Vec2(double(baseFrame->preKeyFrame->gradX()(curPCV)),
+                       double(baseFrame->preKeyFrame->gradY()(curPCV)));
     baseGradNorm[i] = baseGrad[i].normalized();
   }
 }
 
 ImmaturePoint::ImmaturePoint(KeyFrame *baseFrame,
                              PointSerializer<LOAD> &pointSerializer)
-    : baseDirections(
-          baseFrame->tracingSettings.residualPattern.pattern().size())
-    , baseIntencities(
-          baseFrame->tracingSettings.residualPattern.pattern().size())
-    , baseGrad(baseFrame->tracingSettings.residualPattern.pattern().size())
-    , baseGradNorm(baseFrame->tracingSettings.residualPattern.pattern().size())
-    , settings(baseFrame->tracingSettings) {
+    : settings(baseFrame->tracingSettings.get()) {
   cam = baseFrame->preKeyFrame->cam;
   pointSerializer.process(*this);
 
@@ -75,12 +64,34 @@ ImmaturePoint::ImmaturePoint(KeyFrame *baseFrame,
 }
 
 bool ImmaturePoint::isReady() {
-  return state == ACTIVE && stddev < settings.pointTracer.optimizedStddev;
+  return state == ACTIVE && stddev < settings->pointTracer.optimizedStddev;
+}
+
+// estVariance is smallest along the principal direction of the pattern
+// gradients, where the sum of their squared projections is the largest
+// eigenvalue of the sum of their outer products.
+double ImmaturePoint::minTracingStddev() const {
+  Mat22 gradCov = Mat22::Zero();
+  for (int i = 0; i < PS; ++i)
+    gradCov += baseGradNorm[i] * baseGradNorm[i].transpose();
+  double halfTrace = 0.5 * gradCov.trace();
+  double halfDiff = 0.5 * (gradCov(0, 0) - gradCov(1, 1));
+  double maxEigenvalue = halfTrace + std::hypot(halfDiff, gradCov(0, 1));
+  return std::sqrt(PS * settings->pointTracer.positionVariance / maxEigenvalue);
+}
+
+bool ImmaturePoint::canImprove() const {
+  if (state == OOB)
+    return false;
+  if (settings->pointTracer.performFullTracing || numTraced == 0)
+    return true;
+  return minTracingStddev() * settings->pointTracer.imprFactor <= stddev;
 }
 
 bool ImmaturePoint::pointsToTrace(const SE3 &baseToRef, Vec3 &dirMinDepth,
-                                  Vec3 &dirMaxDepth, StdVector<Vec2> &points,
-                                  std::vector<Vec3> &directions) {
+                                  Vec3 &dirMaxDepth, TracingContext &context) {
+  StdVector<Vec2> &points = context.points;
+  StdVector<Vec3> &directions = context.directions;
   points.resize(0);
   directions.resize(0);
 
@@ -89,7 +100,7 @@ bool ImmaturePoint::pointsToTrace(const SE3 &baseToRef, Vec3 &dirMinDepth,
     return false;
   }
 
-  if (settings.pointTracer.performFullTracing) {
+  if (settings->pointTracer.performFullTracing) {
     // While searching along epipolar curve, we will continously map rays on a
     // diametrical segment of a sphere. Since our camera model remains valid
     // only when angle between the mapped ray and Oz is smaller then certain
@@ -101,64 +112,106 @@ bool ImmaturePoint::pointsToTrace(const SE3 &baseToRef, Vec3 &dirMinDepth,
     }
   }
 
-  int maxSearchCount =
-      settings.pointTracer.maxSearchRel * (cam->getWidth() + cam->getHeight());
-  double alpha0 = 0;
-  double step = 1.0 / (settings.pointTracer.onImageTestCount - 1);
-  while (alpha0 <= 1) {
-    Vec3 curDir = (1 - alpha0) * dirMaxDepth + alpha0 * dirMinDepth;
-    Vec2 curP = cam->map(curDir);
-    if (!cam->isOnImage(curP, PH)) {
-      if (!settings.pointTracer.performFullTracing)
+  // The curve is first sampled at onImageTestCount uniform alphas with one
+  // batched projection. Cumulative pixel lengths of the resulting polyline
+  // form a step table, from which the alphas of samples one pixel apart are
+  // interpolated. The samples themselves are projected in one more batch.
+  StdVector<Vec3> &coarseDirs = context.coarseDirections;
+  StdVector<Vec2> &coarsePoints = context.coarsePoints;
+  const int coarseCount = settings->pointTracer.onImageTestCount;
+  const double coarseStep = 1.0 / (coarseCount - 1);
+  auto dirAt = [&](double alpha) -> Vec3 {
+    return (1 - alpha) * dirMaxDepth + alpha * dirMinDepth;
+  };
+  coarseDirs.resize(coarseCount);
+  for (int k = 0; k < coarseCount; ++k)
+    coarseDirs[k] = dirAt(k * coarseStep);
+  cam->mapBatch(coarseDirs, coarsePoints);
+
+  // A run of coarse samples on the image is extended to where the curve
+  // crosses the image border, which is bisected between the outermost sample
+  // on the image and its neighbour off it.
+  constexpr int borderBisectionIters = 16;
+  auto borderAlpha = [&](double inAlpha, double outAlpha) {
+    for (int it = 0; it < borderBisectionIters; ++it) {
+      double midAlpha = 0.5 * (inAlpha + outAlpha);
+      if (cam->isOnImage(cam->map(dirAt(midAlpha)), PH))
+        inAlpha = midAlpha;
+      else
+        outAlpha = midAlpha;
+    }
+    return inAlpha;
+  };
+
+  const bool fullTracing = settings->pointTracer.performFullTracing;
+  const int maxSearchCount =
+      settings->pointTracer.maxSearchRel * (cam->getWidth() + cam->getHeight());
+  double nextLength, length;
+  // Samples the piece of the curve between two alphas, whose projection is
+  // segLength pixels long, continuing the unit steps of the run. Returns
+  // false once the search budget is exhausted.
+  auto sampleSegment = [&](double alphaFrom, double alphaTo,
+                           double segLength) {
+    for (; nextLength < length + segLength; nextLength += 1) {
+      double alpha = alphaFrom + (nextLength - length) / segLength *
+                                     (alphaTo - alphaFrom);
+      directions.push_back(dirAt(alpha));
+      if (!fullTracing && directions.size() >= maxSearchCount)
+        return false;
+    }
+    length += segLength;
+    return true;
+  };
+
+  for (int k = 0; k < coarseCount; ++k) {
+    if (!cam->isOnImage(coarsePoints[k], PH)) {
+      if (!fullTracing)
         break;
-      alpha0 += step;
       continue;
     }
 
-    double alpha;
-    for (int i = 0; i < 2; ++i) {
-      alpha = alpha0;
-      Vec2 point;
-      int pointCnt = 0;
-      do {
-        Vec3 curDir = (1 - alpha) * dirMaxDepth + alpha * dirMinDepth;
-        Mat23 mapJacobian;
-        std::tie(point, mapJacobian) = cam->diffMap(curDir);
-
-        points.push_back(point);
-        directions.push_back(curDir);
-
-        double deltaAlpha =
-            1. / (mapJacobian * (dirMaxDepth - dirMinDepth)).norm();
-        alpha += deltaAlpha;
-
-        pointCnt++;
-        if (!settings.pointTracer.performFullTracing &&
-            pointCnt >= maxSearchCount)
-          break;
-      } while (alpha >= 0 && alpha <= 1 && cam->isOnImage(point, PH));
+    nextLength = 0;
+    length = 0;
+    bool budgetLeft = true;
+    if (k > 0) {
+      double entryAlpha = borderAlpha(k * coarseStep, (k - 1) * coarseStep);
+      budgetLeft = sampleSegment(
+          entryAlpha, k * coarseStep,
+          (coarsePoints[k] - cam->map(dirAt(entryAlpha))).norm());
+    }
+    for (; budgetLeft && k + 1 < coarseCount &&
+           cam->isOnImage(coarsePoints[k + 1], PH);
+         ++k)
+      budgetLeft =
+          sampleSegment(k * coarseStep, (k + 1) * coarseStep,
+                        (coarsePoints[k + 1] - coarsePoints[k]).norm());
+    if (budgetLeft && k + 1 < coarseCount) {
+      double exitAlpha = borderAlpha(k * coarseStep, (k + 1) * coarseStep);
+      sampleSegment(k * coarseStep, exitAlpha,
+                    (cam->map(dirAt(exitAlpha)) - coarsePoints[k]).norm());
     }
 
-    if (!settings.pointTracer.performFullTracing)
+    if (!fullTracing)
       break;
-
-    alpha0 = alpha + step;
   }
 
+  cam->mapBatch(directions, points);
   return points.size() > 1;
 }
 
-Vec2 ImmaturePoint::tracePrecise(
-    const ceres::BiCubicInterpolator<ceres::Grid2D<unsigned char, 1>> &refFrame,
-    const Vec2 &from, const Vec2 &to, const std::vector<double> &intencities,
-    const StdVector<Vec2> &pattern, double &bestDispl, double &bestEnergy) {
+template <typename Interpolator>
+Vec2 ImmaturePoint::tracePrecise(const Interpolator &refFrame, const Vec2 &from,
+                                 const Vec2 &to,
+                                 const std::array<double, MPS> &intencities,
+                                 const std::array<Vec2, MPS> &pattern,
+                                 double &bestDispl, double &bestEnergy) {
   Vec2 dir = to - from;
   dir.normalize();
   Vec2 bestPoint = (from + to) * 0.5;
   bestEnergy = INF;
   bestDispl = 0;
   double step = 0;
-  for (int it = 0; it < settings.pointTracer.gnIter + 1; ++it) {
+  for (int it = 0; it < settings->pointTracer.gnIter + 1; ++it) {
     double newEnergy = 0;
     double H = 0, b = 0;
     Vec2 curPoint = bestPoint + step * dir;
@@ -173,7 +226,7 @@ Vec2 ImmaturePoint::tracePrecise(
       newEnergy += wb * (2 - wb) * ar * ar;
       double dr = grad.dot(dir);
       b += wb * r * dr;
-      if (settings.pointTracer.useAltHWeighting) {
+      if (settings->pointTracer.useAltHWeighting) {
         double wh = wb / (2 - wb);
         H += wh * dr * dr;
       } else
@@ -198,19 +251,41 @@ Vec2 ImmaturePoint::tracePrecise(
 
 double ImmaturePoint::estVariance(const Vec2 &searchDirection) {
   double sum1 = 0;
-  for (const Vec2 &gN : baseGradNorm) {
-    double s = gN.dot(searchDirection);
+  for (int i = 0; i < PS; ++i) {
+    double s = baseGradNorm[i].dot(searchDirection);
     sum1 += s * s;
   }
 
-  lastGeomVar = PS * settings.pointTracer.positionVariance / sum1;
+  lastGeomVar = PS * settings->pointTracer.positionVariance / sum1;
   lastFullVar = lastGeomVar;
   return lastFullVar;
 }
 
+// Pattern offsets are kept as increments of the base rays, rotated into ref.
+ImmaturePoint::PatternReprojector::PatternReprojector(
+    const CameraModel &cam, const SE3 &baseToRef,
+    const std::array<Vec3, MPS> &baseDirections, int patternSize)
+    : cam(cam)
+    , rotatedBaseDir(baseToRef.so3() * baseDirections[0])
+    , translation(baseToRef.translation())
+    , patternSize(patternSize) {
+  const Mat33 baseToRefRot = baseToRef.rotationMatrix();
+  for (int i = 1; i < patternSize; ++i)
+    rotatedDirOffsets[i] =
+        baseToRefRot * (baseDirections[i] - baseDirections[0]);
+}
+
+void ImmaturePoint::PatternReprojector::reproject(
+    const Vec2 &point, double depth, std::array<Vec2, MPS> &reproj) const {
+  Mat23 mapJacobian = cam.diffMap(depth * rotatedBaseDir + translation).second;
+  reproj[0] = point;
+  for (int i = 1; i < patternSize; ++i)
+    reproj[i] = point + depth * (mapJacobian * rotatedDirOffsets[i]);
+}
+
 ImmaturePoint::TracingStatus
 ImmaturePoint::traceOn(const KeyFrame &baseFrame, const PreKeyFrame &refFrame,
-                       TracingDebugType debugType) {
+                       TracingDebugType debugType, TracingContext &context) {
   if (state == OOB)
     return WAS_OOB;
 
@@ -232,44 +307,52 @@ ImmaturePoint::traceOn(const KeyFrame &baseFrame, const PreKeyFrame &refFrame,
   double variance = estVariance(searchDirection);
   double curDev = std::sqrt(variance);
 
-  if (!settings.pointTracer.performFullTracing && numTraced > 0)
-    if (curDev * settings.pointTracer.imprFactor > stddev)
+  if (!settings->pointTracer.performFullTracing && numTraced > 0)
+    if (curDev * settings->pointTracer.imprFactor > stddev)
       return BIG_PREDICTED_ERROR;
 
-  StdVector<Vec2> points;
-  std::vector<Vec3> directions;
-  if (!pointsToTrace(baseToRef, dirMin, dirMax, points, directions)) {
+  if (!pointsToTrace(baseToRef, dirMin, dirMax, context)) {
     return EPIPOLAR_OOB;
   }
+  const StdVector<Vec2> &points = context.points;
+  const StdVector<Vec3> &directions = context.directions;
 
-  std::vector<double> intencities(PS);
+  std::array<double, MPS> intencities;
   for (int i = 0; i < PS; ++i)
     intencities[i] = lightBaseToRef(baseIntencities[i]);
 
-  StdVector<std::pair<Vec2, double>> energiesFound;
-  double bestEnergy = INF;
-  Vec2 bestPoint;
-  double bestDepth;
-  int bestInd;
+  const bool useBilinear = settings->pointTracer.useBilinear;
+
+  const int numPoints = points.size();
+  std::vector<double> &sampledIntencities = context.sampledIntencities;
+  std::vector<double> &energies = context.energies;
+  std::vector<double> &depths = context.depths;
+  std::vector<int> &pyrLevels = context.pyrLevels;
+  sampledIntencities.resize(PS * numPoints);
+  energies.resize(numPoints);
+  depths.resize(numPoints);
+  pyrLevels.resize(numPoints);
+
   pyrChanged = false;
-  int bestPyrLevel = -1;
   int lastPyrLevel = -1;
 
-  for (int dirInd = 0; dirInd < directions.size(); ++dirInd) {
+  const PatternReprojector reprojector(*cam, baseToRef, baseDirections, PS);
+
+  // The intencities are sampled first, so that energies of all points are
+  // computed by one vectorized pass.
+  for (int dirInd = 0; dirInd < numPoints; ++dirInd) {
     Vec3 curDir = directions[dirInd];
     Vec2 point = points[dirInd];
     curDir.normalize();
-    StdVector<Vec2> reproj(PS);
-    reproj[0] = point;
+    std::array<Vec2, MPS> reproj;
     double curDepth = INF;
     if (maxDepth == INF && dirInd == 0) {
+      reproj[0] = point;
       for (int i = 1; i < PS; ++i)
         reproj[i] = cam->map(baseToRef.so3() * baseDirections[i]);
     } else {
-      Vec2 curDepths = triangulate(baseToRef, baseDirections[0], curDir);
-      curDepth = curDepths[0];
-      for (int i = 1; i < PS; ++i)
-        reproj[i] = cam->map(baseToRef * (curDepths[0] * baseDirections[i]));
+      curDepth = triangulate(baseToRef, baseDirections[0], curDir)[0];
+      reprojector.reproject(point, curDepth, reproj);
     }
 
     double maxReprojDist = -1;
@@ -289,26 +372,40 @@ ImmaturePoint::traceOn(const KeyFrame &baseFrame, const PreKeyFrame &refFrame,
 
     lastPyrLevel = pyrLevel;
 
-    for (Vec2 &r : reproj)
-      r /= double(1 << pyrLevel);
+    for (int i = 0; i < PS; ++i)
+      reproj[i] /= double(1 << pyrLevel);
+
+    refFrame.internals->withInterpolator(
+        pyrLevel, useBilinear, [&](const auto &refInterp) {
+          for (int i = 0; i < PS; ++i)
+            refInterp.Evaluate(reproj[i][1], reproj[i][0],
+                               &sampledIntencities[i * numPoints + dirInd]);
+        });
+    depths[dirInd] = curDepth;
+    pyrLevels[dirInd] = pyrLevel;
+  }
 
-    double energy = 0;
-    for (int i = 0; i < PS; ++i) {
-      double refIntencity;
-      refFrame.internals->interpolator(pyrLevel).Evaluate(
-          reproj[i][1], reproj[i][0], &refIntencity);
-      double residual = std::abs(intencities[i] - refIntencity);
-      energy += residual > TH ? TH * (2 * residual - TH) : residual * residual;
-    }
+  patternEnergies(intencities.data(), sampledIntencities.data(), PS,
+                  numPoints, TH, energies.data());
+
+  StdVector<std::pair<Vec2, double>> &energiesFound = context.energiesFound;
+  energiesFound.resize(0);
+  double bestEnergy = INF;
+  Vec2 bestPoint;
+  double bestDepth;
+  int bestInd;
+  int bestPyrLevel = -1;
 
-    energiesFound.push_back({point, energy});
+  for (int dirInd = 0; dirInd < numPoints; ++dirInd) {
+    double energy = energies[dirInd];
+    energiesFound.push_back({points[dirInd], energy});
 
     if (energy < bestEnergy) {
       bestEnergy = energy;
-      bestPoint = point;
-      bestDepth = curDepth;
+      bestPoint = points[dirInd];
+      bestDepth = depths[dirInd];
       bestInd = dirInd;
-      bestPyrLevel = pyrLevel;
+      bestPyrLevel = pyrLevels[dirInd];
     }
   }
 
@@ -326,7 +423,7 @@ ImmaturePoint::traceOn(const KeyFrame &baseFrame, const PreKeyFrame &refFrame,
   double secondBestEnergy = INF;
   for (const auto &p : energiesFound) {
     if ((p.first - bestPoint).norm() <
-        settings.pointTracer.minSecondBestDistance)
+        settings->pointTracer.minSecondBestDistance)
       continue;
     if (p.second < secondBestEnergy)
       secondBestEnergy = p.second;
@@ -336,19 +433,19 @@ ImmaturePoint::traceOn(const KeyFrame &baseFrame, const PreKeyFrame &refFrame,
     return INF_ENERGY;
 
   double secondBestEnergyThres =
-      settings.pointTracer.secondBestEnergyThresFactor * PS * TH * TH;
+      settings->pointTracer.secondBestEnergyThresFactor * PS * TH * TH;
   if (secondBestEnergy <= secondBestEnergyThres)
     return SMALL_ABS_SECOND_BEST;
 
   double outlierEnergy =
-      settings.pointTracer.outlierEnergyFactor * PS * TH * TH;
+      settings->pointTracer.outlierEnergyFactor * PS * TH * TH;
 
   if (lastEnergy > outlierEnergy)
     return BIG_ENERGY;
 
   double newQuality = secondBestEnergy / bestEnergy;
 
-  if (newQuality < settings.pointTracer.outlierQuality)
+  if (newQuality < settings->pointTracer.outlierQuality)
     return LOW_QUALITY;
 
   if (newQuality > bestQuality)
@@ -358,27 +455,29 @@ ImmaturePoint::traceOn(const KeyFrame &baseFrame, const PreKeyFrame &refFrame,
 
   eBeforeSubpixel = bestEnergy;
   depthBeforeSubpixel =
-      triangulate(baseToRef, baseDirections[0], cam->unmap(bestPoint))[0];
+      triangulate(baseToRef, baseDirections[0], cam->unmapUnit(bestPoint))[0];
 
   // subpixel refinement
   double bestDispl = 0;
-  if (settings.pointTracer.gnIter > 0) {
+  if (settings->pointTracer.gnIter > 0) {
     int fromInd = std::max(0, bestInd - 1);
     int toInd = std::min(int(points.size()) - 1, bestInd + 1);
     Vec2 from = points[fromInd];
     Vec2 to = points[toInd];
-    StdVector<Vec2> pattern(PS);
+    std::array<Vec2, MPS> pattern;
     double scale = 1.0 / (1 << bestPyrLevel);
     pattern[0] = Vec2::Zero();
     for (int i = 1; i < PS; ++i) {
       Vec2 reproj = cam->map(baseToRef * (bestDepth * baseDirections[i]));
       pattern[i] = scale * (reproj - points[bestInd]);
     }
-    bestPoint =
-        tracePrecise(refFrame.internals->interpolator(bestPyrLevel), from, to,
-                     intencities, pattern, bestDispl, bestEnergy);
+    bestPoint = refFrame.internals->withInterpolator(
+        bestPyrLevel, useBilinear, [&](const auto &refInterp) {
+          return tracePrecise(refInterp, from, to, intencities, pattern,
+                              bestDispl, bestEnergy);
+        });
     depth = triangulate(baseToRef, baseDirections[0],
-                        cam->unmap(bestPoint / scale))[0];
+                        cam->unmapUnit(bestPoint / scale))[0];
   } else
     depth = bestDepth;
 
@@ -387,16 +486,16 @@ ImmaturePoint::traceOn(const KeyFrame &baseFrame, const PreKeyFrame &refFrame,
   double displ = 2 * curDev;
   // depth bounds
   Vec2 minDepthPos = approxOnCurve(points, bestInd + displ);
-  minDepth =
-      triangulate(baseToRef, baseDirections[0], cam->unmap(minDepthPos))[0];
+  minDepth = triangulate(baseToRef, baseDirections[0],
+                         cam->unmapUnit(minDepthPos))[0];
 
   double maxDepthDispl = bestInd - displ;
   if (maxDepthDispl <= 0)
     maxDepth = INF;
   else {
     Vec2 maxDepthPos = approxOnCurve(points, maxDepthDispl);
-    maxDepth =
-        triangulate(baseToRef, baseDirections[0], cam->unmap(maxDepthPos))[0];
+    maxDepth = triangulate(baseToRef, baseDirections[0],
+                           cam->unmapUnit(maxDepthPos))[0];
   }
 
   lastTraced = true;
@@ -11,16 +11,34 @@ PreKeyFrame::PreKeyFrame(KeyFrame *baseKeyFrame, CameraModel *cam,
                          const cv::Mat &frameColored, int globalFrameNum,
                          const Settings::Pyramid &_pyrSettings)
     : frameColored(frameColored)
-    , framePyr(cvtBgrToGray(frameColored), _pyrSettings.levelNum)
+    , framePyr(cv::Mat3b(frameColored), _pyrSettings.levelNum)
     , baseKeyFrame(baseKeyFrame)
     , cam(cam)
     , globalFrameNum(globalFrameNum)
     , pyrSettings(_pyrSettings)
     , internals(std::unique_ptr<PreKeyFrameInternals>(
-          new PreKeyFrameInternals(framePyr, pyrSettings))) {
-  grad(frame(), gradX, gradY, gradNorm);
-}
+          new PreKeyFrameInternals(framePyr, pyrSettings))) {}
 
 PreKeyFrame::~PreKeyFrame() {}
 
+void PreKeyFrame::computeGradients() const {
+  std::call_once(gradientsComputed,
+                 [this]() { grad(frame(), _gradX, _gradY, _gradNorm); });
+}
+
+const cv::Mat1f &PreKeyFrame::gradX() const {
+  computeGradients();
+  return _gradX;
+}
+
+const cv::Mat1f &PreKeyFrame::gradY() const {
+  computeGradients();
+  return _gradY;
+}
+
+const cv::Mat1f &PreKeyFrame::gradNorm() const {
+  computeGradients();
+  return _gradNorm;
+}
+
 }; // namespace fishdso
@@ -0,0 +1,546 @@
+#include "system/SlidingWindowBundleAdjuster.h"
+#include "PreKeyFrameInternals.h"
+#include "util/defs.h"
+#include "util/util.h"
+#include <Eigen/Eigenvalues>
+#include <chrono>
+#include <unordered_set>
+
+namespace fishdso {
+
+// Photometric residual of one pattern pixel of a point hosted in base and
+// observed in ref, same as in CeresBundleAdjuster. If jBase is not null, also
+// computes its derivatives w.r.t. the base and the ref frame parameters
+// [translation, rotation, affA, affB] and the log inverse depth. Instantiated
+// for each camera type, see CameraModel::withType, and each interpolator.
+template <CameraModel::Type camType, typename Interpolator>
+double evalResidual(const CameraModel &cam, const Interpolator &refFrame,
+                    const Vec3 &direction, double baseIntencity,
+                    double logInvDepth, const KeyFrame &base,
+                    const KeyFrame &ref, Vec8 *jBase, Vec8 *jRef,
+                    double *jDepth) {
+  const Mat33 baseRot = base.thisToWorld.rotationMatrix();
+  const Mat33 refRot = ref.thisToWorld.rotationMatrix();
+  const Vec3 &refTrans = ref.thisToWorld.translation();
+
+  Vec3 rotated = baseRot * (direction * std::exp(-logInvDepth));
+  Vec3 refToPoint = rotated + base.thisToWorld.translation() - refTrans;
+  Vec3 inRef = refRot.transpose() * refToPoint;
+
+  double lightRel =
+      std::exp(base.lightWorldToThis.data[0] - ref.lightWorldToThis.data[0]);
+  double baseTransformed =
+      lightRel * (baseIntencity + base.lightWorldToThis.data[1]);
+
+  if (!jBase) {
+    Vec2 onRef = cam.mapAs<camType>(inRef);
+    double refIntencity;
+    refFrame.Evaluate(onRef[1], onRef[0], &refIntencity);
+    return refIntencity + ref.lightWorldToThis.data[1] - baseTransformed;
+  }
+
+  auto [onRef, mapJacobian] = cam.diffMapAs<camType>(inRef);
+  double refIntencity, dIdy, dIdx;
+  refFrame.Evaluate(onRef[1], onRef[0], &refIntencity, &dIdy, &dIdx);
+
+  Vec3 gradWorld = refRot * (mapJacobian.transpose() * Vec2(dIdx, dIdy));
+  jBase->head<3>() = gradWorld;
+  jBase->segment<3>(3) = rotated.cross(gradWorld);
+  (*jBase)[6] = -baseTransformed;
+  (*jBase)[7] = -lightRel;
+  jRef->head<3>() = -gradWorld;
+  jRef->segment<3>(3) = gradWorld.cross(refToPoint);
+  (*jRef)[6] = baseTransformed;
+  (*jRef)[7] = 1;
+  *jDepth = -gradWorld.dot(rotated);
+
+  return refIntencity + ref.lightWorldToThis.data[1] - baseTransformed;
+}
+
+template <bool bilinear> const auto &refInterpolator(const KeyFrame &ref) {
+  if constexpr (bilinear)
+    return ref.preKeyFrame->internals->bilinear(0);
+  else
+    return ref.preKeyFrame->internals->paddedInterpolator(0);
+}
+
+EIGEN_STRONG_INLINE double huberEnergy(double res, double outlierDiff) {
+  double absRes = std::abs(res);
+  return absRes <= outlierDiff ? 0.5 * res * res
+                               : outlierDiff * (absRes - 0.5 * outlierDiff);
+}
+
+EIGEN_STRONG_INLINE double huberWeight(double res, double outlierDiff) {
+  double absRes = std::abs(res);
+  return absRes <= outlierDiff ? 1.0 : outlierDiff / absRes;
+}
+
+// Symmetric pseudo-inverse, used when marginalizing a keyframe whose block may
+// be rank-deficient (e.g. the fixed first keyframe or disabled affine light).
+MatXX pseudoInverse(const MatXX &H) {
+  Eigen::SelfAdjointEigenSolver<MatXX> eigenSolver(H);
+  VecX eigenvalues = eigenSolver.eigenvalues();
+  double eps = 1e-10 * std::max(1.0, eigenvalues.cwiseAbs().maxCoeff());
+  for (int i = 0; i < eigenvalues.size(); ++i)
+    eigenvalues[i] = eigenvalues[i] > eps ? 1 / eigenvalues[i] : 0;
+  return eigenSolver.eigenvectors() * eigenvalues.asDiagonal() *
+         eigenSolver.eigenvectors().transpose();
+}
+
+SlidingWindowBundleAdjuster::SlidingWindowBundleAdjuster(
+    CameraModel *cam, const BundleAdjusterSettings &_settings)
+    : cam(cam)
+    , settings(_settings) {}
+
+int SlidingWindowBundleAdjuster::frameIndex(const KeyFrame *keyFrame) const {
+  return std::find(keyFrames.begin(), keyFrames.end(), keyFrame) -
+         keyFrames.begin();
+}
+
+void SlidingWindowBundleAdjuster::addKeyFrame(KeyFrame *keyFrame) {
+  keyFrames.push_back(keyFrame);
+  priorLinearization.push_back(
+      {keyFrame->thisToWorld, keyFrame->lightWorldToThis});
+
+  int newSize = frameParams * keyFrames.size();
+  priorH.conservativeResize(newSize, newSize);
+  priorB.conservativeResize(newSize);
+  priorH.rightCols<frameParams>().setZero();
+  priorH.bottomRows<frameParams>().setZero();
+  priorB.tail<frameParams>().setZero();
+}
+
+bool SlidingWindowBundleAdjuster::isOOB(
+    const KeyFrame &baseFrame, const KeyFrame &refFrame,
+    const OptimizedPoint &optimizedPoint) const {
+  Vec3 inBase = cam->unmapUnit(optimizedPoint.p) * optimizedPoint.depth();
+  Vec2 reproj = cam->map(refFrame.thisToWorld.inverse() *
+                         baseFrame.thisToWorld * inBase);
+  return !cam->isOnImage(reproj, settings.residualPattern.height);
+}
+
+void SlidingWindowBundleAdjuster::updatePoints() {
+  std::unordered_set<const OptimizedPoint *> known;
+  for (const auto &point : points)
+    known.insert(point->optimizedPoint);
+
+  const double c = settings.gradWeighting.c;
+  const StdVector<Vec2> &pattern = settings.residualPattern.pattern();
+  for (KeyFrame *baseFrame : keyFrames)
+    for (const auto &op : baseFrame->optimizedPoints) {
+      if (!std::isfinite(op->logInvDepth) || known.count(op.get()))
+        continue;
+
+      std::unique_ptr<Point> point(new Point());
+      point->baseFrame = baseFrame;
+      point->optimizedPoint = op.get();
+      point->directions.reserve(pattern.size());
+      point->intencities.reserve(pattern.size());
+      point->weights.reserve(pattern.size());
+      for (const Vec2 &shift : pattern) {
+        Vec2 pos = op->p + shift;
+        double intencity;
+        baseFrame->preKeyFrame->internals->interpolator(0).Evaluate(
+            pos[1], pos[0], &intencity);
+        double gradNorm = baseFrame->preKeyFrame->gradNorm()(toCvPoint(pos));
+        point->directions.push_back(cam->unmapUnit(pos));
+        point->intencities.push_back(intencity);
+        point->weights.push_back(c / std::hypot(c, gradNorm));
+      }
+      points.push_back(std::move(point));
+    }
+
+  int pointsTotal = 0, pointsOOB = 0;
+  for (const auto &point : points) {
+    point->refFrames.clear();
+    for (KeyFrame *refFrame : keyFrames) {
+      if (refFrame == point->baseFrame)
+        continue;
+      pointsTotal++;
+      if (isOOB(*point->baseFrame, *refFrame, *point->optimizedPoint))
+        pointsOOB++;
+      else
+        point->refFrames.push_back(refFrame);
+    }
+  }
+
+  LOG(INFO) << "total points = " << pointsTotal;
+  LOG(INFO) << "OOB points = " << pointsOOB;
+}
+
+double SlidingWindowBundleAdjuster::energy() const {
+  return cam->withType([this](auto camType) {
+    constexpr CameraModel::Type type = decltype(camType)::value;
+    return settings.bundleAdjuster.useBilinear ? energy<type, true>()
+                                               : energy<type, false>();
+  });
+}
+
+template <CameraModel::Type camType, bool bilinear>
+double SlidingWindowBundleAdjuster::energy() const {
+  const double outlierDiff = settings.intencity.outlierDiff;
+  double result = 0;
+  for (const auto &point : points)
+    for (KeyFrame *refFrame : point->refFrames) {
+      const auto &refInterp = refInterpolator<bilinear>(*refFrame);
+      for (int i = 0; i < point->directions.size(); ++i) {
+        double res = evalResidual<camType>(
+            *cam, refInterp, point->directions[i], point->intencities[i],
+            point->optimizedPoint->logInvDepth, *point->baseFrame, *refFrame,
+            nullptr, nullptr, nullptr);
+        result += point->weights[i] * huberEnergy(res, outlierDiff);
+      }
+    }
+  return result + priorEnergy();
+}
+
+VecX SlidingWindowBundleAdjuster::stateDiff() const {
+  VecX diff(frameParams * keyFrames.size());
+  for (int k = 0; k < keyFrames.size(); ++k) {
+    const KeyFrame *kf = keyFrames[k];
+    const FrameState &lin = priorLinearization[k];
+    diff.segment<3>(frameParams * k) =
+        kf->thisToWorld.translation() - lin.thisToWorld.translation();
+    diff.segment<3>(frameParams * k + 3) =
+        (kf->thisToWorld.so3() * lin.thisToWorld.so3().inverse()).log();
+    diff[frameParams * k + 6] =
+        kf->lightWorldToThis.data[0] - lin.lightWorldToThis.data[0];
+    diff[frameParams * k + 7] =
+        kf->lightWorldToThis.data[1] - lin.lightWorldToThis.data[1];
+  }
+  return diff;
+}
+
+double SlidingWindowBundleAdjuster::priorEnergy() const {
+  VecX diff = stateDiff();
+  return diff.dot(priorB) + 0.5 * diff.dot(priorH * diff);
+}
+
+void SlidingWindowBundleAdjuster::linearize(
+    const std::vector<Point *> &linPoints, System &system) const {
+  cam->withType([&](auto camType) {
+    constexpr CameraModel::Type type = decltype(camType)::value;
+    if (settings.bundleAdjuster.useBilinear)
+      linearize<type, true>(linPoints, system);
+    else
+      linearize<type, false>(linPoints, system);
+  });
+}
+
+template <CameraModel::Type camType, bool bilinear>
+void SlidingWindowBundleAdjuster::linearize(
+    const std::vector<Point *> &linPoints, System &system) const {
+  const int frameDim = frameParams * keyFrames.size();
+  const double outlierDiff = settings.intencity.outlierDiff;
+  system.H.setZero(frameDim, frameDim);
+  system.b.setZero(frameDim);
+  system.Hfd.setZero(frameDim, linPoints.size());
+  system.Hdd.setZero(linPoints.size());
+  system.bd.setZero(linPoints.size());
+
+  Vec8 jBase, jRef;
+  double jDepth;
+  for (int j = 0; j < linPoints.size(); ++j) {
+    const Point &point = *linPoints[j];
+    int bi = frameParams * frameIndex(point.baseFrame);
+    for (KeyFrame *refFrame : point.refFrames) {
+      int ri = frameParams * frameIndex(refFrame);
+      const auto &refInterp = refInterpolator<bilinear>(*refFrame);
+      for (int i = 0; i < point.directions.size(); ++i) {
+        double res = evalResidual<camType>(
+            *cam, refInterp, point.directions[i], point.intencities[i],
+            point.optimizedPoint->logInvDepth, *point.baseFrame, *refFrame,
+            &jBase, &jRef, &jDepth);
+        if (!settings.affineLight.optimizeAffineLight) {
+          jBase.tail<2>().setZero();
+          jRef.tail<2>().setZero();
+        }
+        double w = point.weights[i] * huberWeight(res, outlierDiff);
+
+        system.H.block<frameParams, frameParams>(bi, bi) +=
+            w * jBase * jBase.transpose();
+        system.H.block<frameParams, frameParams>(bi, ri) +=
+            w * jBase * jRef.transpose();
+        system.H.block<frameParams, frameParams>(ri, bi) +=
+            w * jRef * jBase.transpose();
+        system.H.block<frameParams, frameParams>(ri, ri) +=
+            w * jRef * jRef.transpose();
+        system.b.segment<frameParams>(bi) += w * res * jBase;
+        system.b.segment<frameParams>(ri) += w * res * jRef;
+        system.Hfd.block<frameParams, 1>(bi, j) += w * jDepth * jBase;
+        system.Hfd.block<frameParams, 1>(ri, j) += w * jDepth * jRef;
+        system.Hdd[j] += w * jDepth * jDepth;
+        system.bd[j] += w * jDepth * res;
+      }
+    }
+  }
+}
+
+// Maps the free parameters to the full [frames] parameter vector. The first
+// keyframe is fixed and the second one moves on a sphere around it, which
+// fixes the gauge (including scale).
+MatXX SlidingWindowBundleAdjuster::freeParamsBasis() const {
+  const int frameDim = frameParams * keyFrames.size();
+  const bool optimizeAffLight = settings.affineLight.optimizeAffineLight;
+  std::vector<std::pair<int, Vec3>> columns;
+  auto addFrameColumns = [&](int k, bool withTrans, bool withRot) {
+    for (int i = 0; withTrans && i < 3; ++i)
+      columns.push_back({frameParams * k + i, Vec3::Zero()});
+    for (int i = 3; withRot && i < 6; ++i)
+      columns.push_back({frameParams * k + i, Vec3::Zero()});
+    for (int i = 6; optimizeAffLight && i < 8; ++i)
+      columns.push_back({frameParams * k + i, Vec3::Zero()});
+  };
+
+  if (keyFrames.size() < 2)
+    return MatXX::Zero(frameDim, 0);
+
+  bool secondFixed = settings.bundleAdjuster.fixedMotionOnFirstAdjustent &&
+                     keyFrames.size() == 2;
+  if (!secondFixed) {
+    Vec3 k = (keyFrames[1]->thisToWorld.translation() -
+              keyFrames[0]->thisToWorld.translation())
+                 .normalized();
+    Vec3 v1 = k.unitOrthogonal();
+    columns.push_back({-1, v1});
+    columns.push_back({-1, k.cross(v1)});
+    addFrameColumns(1, false, !settings.bundleAdjuster.fixedRotationOnSecondKF);
+  }
+  for (int k = 2; k < keyFrames.size(); ++k)
+    addFrameColumns(k, true, true);
+
+  MatXX basis = MatXX::Zero(frameDim, columns.size());
+  for (int c = 0; c < columns.size(); ++c)
+    if (columns[c].first >= 0)
+      basis(columns[c].first, c) = 1;
+    else
+      basis.block<3, 1>(frameParams, c) = columns[c].second;
+  return basis;
+}
+
+void SlidingWindowBundleAdjuster::applyStep(const VecX &framesStep,
+                                            const VecX &depthsStep) {
+  const Settings::AffineLight &light = settings.affineLight;
+  const Vec3 center = keyFrames[0]->thisToWorld.translation();
+  const double radius =
+      keyFrames.size() >= 2
+          ? (keyFrames[1]->thisToWorld.translation() - center).norm()
+          : 0;
+
+  for (int k = 0; k < keyFrames.size(); ++k) {
+    KeyFrame *kf = keyFrames[k];
+    const auto step = framesStep.segment<frameParams>(frameParams * k);
+    Vec3 trans = kf->thisToWorld.translation() + step.head<3>();
+    if (k == 1)
+      trans = center + radius * (trans - center).normalized();
+    kf->thisToWorld =
+        SE3(SO3::exp(step.segment<3>(3)) * kf->thisToWorld.so3(), trans);
+    kf->lightWorldToThis.data[0] =
+        std::clamp(kf->lightWorldToThis.data[0] + step[6],
+                   light.minAffineLightA, light.maxAffineLightA);
+    kf->lightWorldToThis.data[1] =
+        std::clamp(kf->lightWorldToThis.data[1] + step[7],
+                   light.minAffineLightB, light.maxAffineLightB);
+  }
+
+  for (int j = 0; j < points.size(); ++j) {
+    double &logInvDepth = points[j]->optimizedPoint->logInvDepth;
+    logInvDepth =
+        std::clamp(logInvDepth + depthsStep[j], -std::log(settings.depth.max),
+                   -std::log(settings.depth.min));
+  }
+}
+
+void SlidingWindowBundleAdjuster::adjust(int maxNumIterations) {
+  if (keyFrames.size() < 2) {
+    LOG(WARNING) << "too few keyframes to run bundle adjustment";
+    return;
+  }
+
+  auto startTime = std::chrono::steady_clock::now();
+
+  updatePoints();
+
+  std::vector<Point *> pointPtrs;
+  pointPtrs.reserve(points.size());
+  for (const auto &point : points)
+    pointPtrs.push_back(point.get());
+
+  StdVector<FrameState> savedFrames(keyFrames.size());
+  std::vector<double> savedDepths(points.size());
+
+  System system;
+  auto linearizeWithPrior = [&]() {
+    linearize(pointPtrs, system);
+    system.H += priorH;
+    system.b += priorB + priorH * stateDiff();
+  };
+  linearizeWithPrior();
+
+  double curEnergy = energy();
+  const double initialEnergy = curEnergy;
+  double lambda = settings.bundleAdjuster.initialLambda;
+  int it = 0;
+  for (; it < maxNumIterations; ++it) {
+    VecX invHdd(points.size());
+    for (int j = 0; j < points.size(); ++j)
+      invHdd[j] =
+          system.Hdd[j] > 0 ? 1.0 / (system.Hdd[j] * (1 + lambda)) : 0.0;
+
+    MatXX HfdScaled = system.Hfd * invHdd.asDiagonal();
+    MatXX Hsc = system.H - HfdScaled * system.Hfd.transpose();
+    VecX bsc = system.b - HfdScaled * system.bd;
+
+    MatXX basis = freeParamsBasis();
+    MatXX Hr = basis.transpose() * Hsc * basis;
+    Hr.diagonal() *= 1 + lambda;
+    VecX framesStep = -basis * Hr.ldlt().solve(basis.transpose() * bsc);
+    VecX depthsStep = -invHdd.cwiseProduct(
+        system.bd + system.Hfd.transpose() * framesStep);
+    if (!framesStep.allFinite() || !depthsStep.allFinite())
+      break;
+
+    for (int k = 0; k < keyFrames.size(); ++k)
+      savedFrames[k] = {keyFrames[k]->thisToWorld,
+                        keyFrames[k]->lightWorldToThis};
+    for (int j = 0; j < points.size(); ++j)
+      savedDepths[j] = points[j]->optimizedPoint->logInvDepth;
+
+    applyStep(framesStep, depthsStep);
+    double newEnergy = energy();
+
+    if (newEnergy < curEnergy) {
+      curEnergy = newEnergy;
+      lambda *= 0.5;
+      linearizeWithPrior();
+    } else {
+      for (int k = 0; k < keyFrames.size(); ++k) {
+        keyFrames[k]->thisToWorld = savedFrames[k].thisToWorld;
+        keyFrames[k]->lightWorldToThis = savedFrames[k].lightWorldToThis;
+      }
+      for (int j = 0; j < points.size(); ++j)
+        points[j]->optimizedPoint->logInvDepth = savedDepths[j];
+      lambda *= 4;
+    }
+
+    if (framesStep.norm() + depthsStep.norm() <
+        settings.bundleAdjuster.minStepNorm)
+      break;
+  }
+
+  KeyFrame *secondKeyFrame = keyFrames[1];
+  int pointsOutliers = 0;
+  for (const auto &point : points) {
+    if (point->baseFrame != secondKeyFrame ||
+        point->optimizedPoint->state == OptimizedPoint::OOB)
+      continue;
+
+    std::vector<double> values;
+    cam->withType([&](auto camType) {
+      for (KeyFrame *refFrame : point->refFrames)
+        refFrame->preKeyFrame->internals->withInterpolator(
+            0, settings.bundleAdjuster.useBilinear, [&](const auto &refInterp) {
+              for (int i = 0; i < point->directions.size(); ++i)
+                values.push_back(evalResidual<decltype(camType)::value>(
+                    *cam, refInterp, point->directions[i],
+                    point->intencities[i], point->optimizedPoint->logInvDepth,
+                    *point->baseFrame, *refFrame, nullptr, nullptr, nullptr));
+            });
+    });
+
+    if (values.empty()) {
+      point->optimizedPoint->state = OptimizedPoint::OOB;
+      continue;
+    }
+
+    std::nth_element(values.begin(), values.begin() + values.size() / 2,
+                     values.end());
+    double median = values[values.size() / 2];
+    if (median > settings.intencity.outlierDiff) {
+      point->optimizedPoint->state = OptimizedPoint::OUTLIER;
+      pointsOutliers++;
+    }
+  }
+
+  auto endTime = std::chrono::steady_clock::now();
+  LOG(INFO) << "BA results:";
+  LOG(INFO) << "iterations = " << it << ", energy: " << initialEnergy
+            << " -> " << curEnergy;
+  LOG(INFO) << "outlier points = " << pointsOutliers;
+  LOG(INFO) << "time (ms) = "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(
+                   endTime - startTime)
+                   .count()
+            << std::endl;
+}
+
+void SlidingWindowBundleAdjuster::marginalizeKeyFrame(KeyFrame *keyFrame) {
+  const int mi = frameIndex(keyFrame);
+  CHECK(mi < keyFrames.size());
+
+  // move the prior to the current state, so that the new information can be
+  // added at the same linearization point
+  priorB += priorH * stateDiff();
+  for (int k = 0; k < keyFrames.size(); ++k)
+    priorLinearization[k] = {keyFrames[k]->thisToWorld,
+                             keyFrames[k]->lightWorldToThis};
+
+  // points hosted in the marginalized frame are marginalized together with it
+  std::vector<Point *> hosted;
+  for (const auto &point : points)
+    if (point->baseFrame == keyFrame && !point->refFrames.empty())
+      hosted.push_back(point.get());
+  if (!hosted.empty()) {
+    System system;
+    linearize(hosted, system);
+    VecX invHdd(hosted.size());
+    for (int j = 0; j < hosted.size(); ++j)
+      invHdd[j] = system.Hdd[j] > 0 ? 1.0 / system.Hdd[j] : 0.0;
+    MatXX HfdScaled = system.Hfd * invHdd.asDiagonal();
+    priorH += system.H - HfdScaled * system.Hfd.transpose();
+    priorB += system.b - HfdScaled * system.bd;
+  }
+
+  // Schur complement of the marginalized frame's parameters
+  const int frameDim = frameParams * keyFrames.size();
+  const int restDim = frameDim - frameParams;
+  std::vector<int> rest;
+  rest.reserve(restDim);
+  for (int i = 0; i < frameDim; ++i)
+    if (i / frameParams != mi)
+      rest.push_back(i);
+
+  MatXX Hrr(restDim, restDim), Hrm(restDim, frameParams);
+  VecX br(restDim);
+  for (int i = 0; i < restDim; ++i) {
+    br[i] = priorB[rest[i]];
+    for (int j = 0; j < restDim; ++j)
+      Hrr(i, j) = priorH(rest[i], rest[j]);
+    Hrm.row(i) = priorH.block<1, frameParams>(rest[i], frameParams * mi);
+  }
+  MatXX HmmInv = pseudoInverse(
+      priorH.block<frameParams, frameParams>(frameParams * mi,
+                                             frameParams * mi));
+  priorH = Hrr - Hrm * HmmInv * Hrm.transpose();
+  priorB = br - Hrm * HmmInv * priorB.segment<frameParams>(frameParams * mi);
+  priorLinearization.erase(priorLinearization.begin() + mi);
+
+  // residuals of the other points on this frame are dropped to keep the depth
+  // block diagonal
+  points.erase(std::remove_if(points.begin(), points.end(),
+                              [keyFrame](const std::unique_ptr<Point> &p) {
+                                return p->baseFrame == keyFrame;
+                              }),
+               points.end());
+  for (const auto &point : points)
+    point->refFrames.erase(std::remove(point->refFrames.begin(),
+                                       point->refFrames.end(), keyFrame),
+                           point->refFrames.end());
+
+  keyFrames.erase(keyFrames.begin() + mi);
+
+  LOG(INFO) << "marginalized a keyframe, " << hosted.size()
+            << " points went into the prior";
+}
+
+} // namespace fishdso
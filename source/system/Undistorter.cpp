@@ -0,0 +1,39 @@
+#include "system/Undistorter.h"
+#include <opencv2/imgproc.hpp>
+
+namespace fishdso {
+
+Undistorter::Undistorter(const CameraModel &cam, const Mat33 &cameraMatrix)
+    : Undistorter(cam, cameraMatrix, cam.getWidth(), cam.getHeight()) {}
+
+Undistorter::Undistorter(const CameraModel &cam, const Mat33 &cameraMatrix,
+                         int width, int height) {
+  Mat33 Kinv = cameraMatrix.inverse();
+  cv::Mat1f mapX(height, width), mapY(height, width);
+
+  StdVector<Vec3> rays(width);
+  StdVector<Vec2> origPix;
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x)
+      rays[x] = Kinv * Vec3(double(x), double(y), 1.);
+    cam.mapBatch(rays, origPix);
+    for (int x = 0; x < width; ++x) {
+      mapX(y, x) = origPix[x][0];
+      mapY(y, x) = origPix[x][1];
+    }
+  }
+
+  cv::convertMaps(mapX, mapY, map1, map2, CV_16SC2);
+}
+
+cv::Mat Undistorter::undistort(const cv::Mat &img) const {
+  cv::Mat result;
+  undistort(img, result);
+  return result;
+}
+
+void Undistorter::undistort(const cv::Mat &img, cv::Mat &result) const {
+  cv::remap(img, result, map1, map2, cv::INTER_LINEAR, cv::BORDER_CONSTANT);
+}
+
+} // namespace fishdso
@@ -167,6 +167,19 @@ void KeyFrameLoader::loadPointVector(
     pointVector.emplace_back(new PointT(&baseFrame, pointSerializer));
 }
 
+template <typename PointT>
+void KeyFrameLoader::loadPointVector(
+    DataSerializer<LOAD> &ownData, KeyFrame &baseFrame,
+    StdVector<PointT> &pointVector,
+    PointSerializer<LOAD> &pointSerializer) const {
+  int size;
+  ownData.process(size);
+  pointVector.reserve(size);
+  pointVector.clear();
+  for (int j = 0; j < size; ++j)
+    pointVector.emplace_back(&baseFrame, pointSerializer);
+}
+
 void KeyFrameLoader::loadTrackedVector(DataSerializer<LOAD> &ownData,
                                        KeyFrame &keyFrame) const {
   int size;
@@ -219,6 +232,15 @@ void KeyFrameSaver::storePointVector(
     pointSerializer.process(*pointVector[j]);
 }
 
+template <typename PointT>
+void KeyFrameSaver::storePointVector(
+    DataSerializer<STORE> &ownData, const StdVector<PointT> &pointVector,
+    PointSerializer<STORE> &pointSerializer) const {
+  ownData.process(int(pointVector.size()));
+  for (int j = 0; j < pointVector.size(); ++j)
+    pointSerializer.process(pointVector[j]);
+}
+
 void KeyFrameSaver::storeTrackedVector(DataSerializer<STORE> &ownData,
                                        const KeyFrame &keyFrame) const {
   ownData.process(int(keyFrame.trackedFrames.size()));
@@ -1,5 +1,6 @@
 #include "util/DepthedImagePyramid.h"
 #include "util/util.h"
+#include <algorithm>
 #include <glog/logging.h>
 
 namespace fishdso {
@@ -9,27 +10,58 @@ DepthedImagePyramid::DepthedImagePyramid(const cv::Mat1b &baseImage,
                                          const StdVector<Vec2> &points,
                                          const std::vector<double> &depthsVec,
                                          const std::vector<double> &weightsVec)
-    : ImagePyramid(baseImage, levelNum)
-    , depths(levelNum) {
+    : DepthedImagePyramid(ImagePyramid(baseImage, levelNum), levelNum, points,
+                          depthsVec, weightsVec) {}
+
+DepthedImagePyramid::DepthedImagePyramid(const ImagePyramid &imagePyr,
+                                         int levelNum,
+                                         const StdVector<Vec2> &points,
+                                         const std::vector<double> &depthsVec,
+                                         const std::vector<double> &weightsVec)
+    : ImagePyramid(imagePyr, levelNum)
+    , depthedPixels(levelNum) {
   CHECK(points.size() == depthsVec.size() &&
         depthsVec.size() == weightsVec.size());
 
-  depths[0] = cv::Mat1d(baseImage.rows, baseImage.cols, -1.0);
-  cv::Mat1d weights = cv::Mat1d(baseImage.rows, baseImage.cols, 0.0);
-  for (int i = 0; i < points.size(); ++i) {
-    cv::Point cvp = toCvPoint(points[i]);
-    depths[0](cvp) = depthsVec[i];
-    weights(cvp) = weightsVec[i];
-  }
+  // Each point is splatted into its cell on every level. Sorting the splats
+  // by cell groups the points of one cell together.
+  struct Splat {
+    int cell;
+    double weightedDepth;
+    double weight;
+  };
+  std::vector<Splat> splats;
+  splats.reserve(points.size());
 
-  cv::Mat1d weightedDepths = depths[0].mul(weights, 1);
-  cv::Mat1d integralWeightedDepths;
-  cv::Mat1d integralWeights;
-  cv::integral(weights, integralWeights, CV_64F);
-  cv::integral(weightedDepths, integralWeightedDepths, CV_64F);
+  for (int il = 0; il < levelNum; ++il) {
+    const int w = images[il].cols, h = images[il].rows;
+    splats.clear();
+    for (int i = 0; i < points.size(); ++i) {
+      cv::Point cvp = toCvPoint(points[i]);
+      if (cvp.x < 0 || cvp.y < 0)
+        continue;
+      int x = cvp.x >> il, y = cvp.y >> il;
+      if (x < w && y < h)
+        splats.push_back(
+            {y * w + x, weightsVec[i] * depthsVec[i], weightsVec[i]});
+    }
+    std::sort(splats.begin(), splats.end(),
+              [](const Splat &a, const Splat &b) { return a.cell < b.cell; });
 
-  for (int il = 1; il < levelNum; ++il)
-    depths[il] = pyrNUpDepth(integralWeightedDepths, integralWeights, il);
+    std::vector<DepthedPixel> &levelPixels = depthedPixels[il];
+    levelPixels.reserve(splats.size());
+    for (auto it = splats.begin(); it != splats.end();) {
+      int cell = it->cell;
+      double depthsSum = 0, weightsSum = 0;
+      for (; it != splats.end() && it->cell == cell; ++it) {
+        depthsSum += it->weightedDepth;
+        weightsSum += it->weight;
+      }
+      if (std::abs(weightsSum) > 1e-8)
+        levelPixels.push_back(
+            {cv::Point(cell % w, cell / w), depthsSum / weightsSum});
+    }
+  }
 }
 
 } // namespace fishdso
@@ -3,11 +3,82 @@
 
 namespace fishdso {
 
+// Fills the border of padded with copies of the edge pixels of the image
+// inside it.
+void replicateBorder(cv::Mat1b &padded, int border) {
+  const int rows = padded.rows - 2 * border, cols = padded.cols - 2 * border;
+  if (rows <= 0 || cols <= 0)
+    return;
+  for (int y = border; y < border + rows; ++y) {
+    unsigned char *row = padded[y];
+    std::fill(row, row + border, row[border]);
+    std::fill(row + border + cols, row + padded.cols, row[border + cols - 1]);
+  }
+  const unsigned char *first = padded[border];
+  const unsigned char *last = padded[border + rows - 1];
+  for (int y = 0; y < border; ++y) {
+    std::copy(first, first + padded.cols, padded[y]);
+    std::copy(last, last + padded.cols, padded[border + rows + y]);
+  }
+}
+
 ImagePyramid::ImagePyramid(const cv::Mat1b &baseImage, int levelNum)
-    : images(levelNum) {
-  images[0] = baseImage;
-  for (int lvl = 1; lvl < levelNum; ++lvl)
-    images[lvl] = boxFilterPyrDown<unsigned char>(images[lvl - 1]);
+    : images(levelNum)
+    , paddedImages(levelNum) {
+  createLevel(0, baseImage.rows, baseImage.cols);
+  baseImage.copyTo(images[0]);
+  replicateBorder(paddedImages[0], border);
+  buildLevels(1);
+}
+
+ImagePyramid::ImagePyramid(const cv::Mat3b &coloredImage, int levelNum)
+    : images(levelNum)
+    , paddedImages(levelNum) {
+  createLevel(0, coloredImage.rows, coloredImage.cols);
+  // the destination has the right size and type, so it is written in place
+  cv::cvtColor(coloredImage, images[0], cv::COLOR_BGR2GRAY);
+  replicateBorder(paddedImages[0], border);
+  buildLevels(1);
+}
+
+ImagePyramid::ImagePyramid(const ImagePyramid &other, int levelNum)
+    : images(levelNum)
+    , paddedImages(levelNum) {
+  int shared = std::min(levelNum, int(other.images.size()));
+  std::copy(other.images.begin(), other.images.begin() + shared,
+            images.begin());
+  std::copy(other.paddedImages.begin(), other.paddedImages.begin() + shared,
+            paddedImages.begin());
+  buildLevels(shared);
+}
+
+void ImagePyramid::createLevel(int lvl, int rows, int cols) {
+  paddedImages[lvl].create(rows + 2 * border, cols + 2 * border);
+  images[lvl] = paddedImages[lvl](cv::Rect(border, border, cols, rows));
+}
+
+void ImagePyramid::buildLevels(int fromLvl) {
+  const int levelNum = images.size();
+  if (fromLvl >= levelNum)
+    return;
+  for (int lvl = fromLvl; lvl < levelNum; ++lvl)
+    createLevel(lvl, images[lvl - 1].rows / 2, images[lvl - 1].cols / 2);
+
+  // All levels are built in one pass over the last given level. As soon as
+  // two rows of a level are ready, the row they form on the next level is
+  // computed, while the source rows are still in cache.
+  for (int y = 1; y < images[fromLvl - 1].rows; y += 2)
+    for (int lvl = fromLvl, row = y / 2;
+         lvl < levelNum && row < images[lvl].rows; ++lvl, row /= 2) {
+      boxFilterPyrDownRow(images[lvl - 1][2 * row],
+                          images[lvl - 1][2 * row + 1], images[lvl][row],
+                          images[lvl].cols);
+      if (row % 2 == 0)
+        break;
+    }
+
+  for (int lvl = fromLvl; lvl < levelNum; ++lvl)
+    replicateBorder(paddedImages[lvl], border);
 }
 
 } // namespace fishdso
@@ -14,7 +14,7 @@ PixelSelector::PixelSelector(const Settings::PixelSelector &_settings)
     , settings(_settings) {}
 
 std::vector<cv::Point> PixelSelector::select(const cv::Mat &frame,
-                                             const cv::Mat1d &gradNorm,
+                                             const cv::Mat1f &gradNorm,
                                              int pointsNeeded,
                                              cv::Mat *debugOut) {
   int newBlockSize =
@@ -39,7 +39,7 @@ void selectLayer(const cv::Mat &gradNorm, int selBlockSize, double threshold,
 }
 
 std::vector<cv::Point> PixelSelector::selectInternal(const cv::Mat &frame,
-                                                     const cv::Mat1d &gradNorm,
+                                                     const cv::Mat1f &gradNorm,
                                                      int pointsNeeded,
                                                      int blockSize,
                                                      cv::Mat *debugOut) {
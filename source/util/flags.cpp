@@ -31,6 +31,13 @@ DEFINE_bool(use_alt_H_weighting,
             Settings::PointTracer::default_useAltHWeighting,
             "Do we need to use alternative formula for H robust weighting when "
             "performing subpixel tracing?");
+DEFINE_bool(bilinear_tracing, Settings::PointTracer::default_useBilinear,
+            "Sample intensities with the bilinear interpolator over "
+            "precomputed gradients instead of the bicubic one when tracing "
+            "points? Faster, but less accurate.");
+DEFINE_int32(max_traced_points, Settings::PointTracer::default_maxTracedPoints,
+             "Max number of immature points traced on each frame, the ones "
+             "expected to improve the most go first. 0 means no limit.");
 DEFINE_int32(tracing_GN_iter, Settings::PointTracer::default_gnIter,
              "Max number of GN iterations when performing subpixel tracing. "
              "Set to 0 to disable subpixel tracing.");
@@ -54,9 +61,24 @@ DEFINE_double(track_fail_factor,
               Settings::FrameTracker::default_trackFailFactor,
               "If RMSE after tracking another frame grew by this factor, "
               "tracking is considered failed.");
+DEFINE_bool(use_ceres_tracking, Settings::FrameTracker::default_useCeres,
+            "Track frames with Ceres Solver instead of the hand-written "
+            "Gauss-Newton solver? Much slower, useful for comparison.");
+DEFINE_int32(tracking_max_iter, Settings::FrameTracker::default_maxIterations,
+             "Max number of Gauss-Newton iterations per pyramid level when "
+             "tracking a frame.");
+DEFINE_bool(bilinear_tracking, Settings::FrameTracker::default_useBilinear,
+            "Sample intensities with the bilinear interpolator when tracking "
+            "frames? Not used by the Ceres tracker.");
 
 DEFINE_bool(run_ba, Settings::BundleAdjuster::default_runBA,
             "Do we need to run bundle adjustment?");
+DEFINE_bool(use_ceres_ba, Settings::BundleAdjuster::default_useCeres,
+            "Run bundle adjustment with Ceres Solver instead of the "
+            "hand-written sliding window solver with marginalization?");
+DEFINE_bool(bilinear_ba, Settings::BundleAdjuster::default_useBilinear,
+            "Sample intensities with the bilinear interpolator in the sliding "
+            "window bundle adjuster?");
 
 DEFINE_bool(fixed_motion_on_first_ba,
             Settings::BundleAdjuster::default_fixedMotionOnFirstAdjustent,
@@ -69,8 +91,15 @@ DEFINE_double(optimized_stddev, Settings::PointTracer::default_optimizedStddev,
 
 DEFINE_int32(shift_between_keyframes, Settings::default_shiftBetweenKeyFrames,
              "Difference in frame numbers between chosen keyFrames.");
+DEFINE_bool(background_mapping, Settings::default_backgroundMapping,
+            "Trace points, create keyframes and run bundle adjustment in a "
+            "separate thread, so that adding a frame returns right after it "
+            "is tracked?");
 DEFINE_bool(deterministic, true,
             "Do we need deterministic random number generation?");
+DEFINE_string(camera_cache_dir, Settings::CameraModel::default_cacheDirectory,
+              "Directory to cache the fitted camera calibration and ray tables "
+              "in. Empty means no caching.");
 
 namespace fishdso {
 
@@ -89,16 +118,25 @@ Settings getFlaggedSettings() {
   settings.pointTracer.performFullTracing = FLAGS_perform_full_tracing;
   settings.pointTracer.useAltHWeighting = FLAGS_use_alt_H_weighting;
   settings.pointTracer.gnIter = FLAGS_tracing_GN_iter;
+  settings.pointTracer.useBilinear = FLAGS_bilinear_tracing;
+  settings.pointTracer.maxTracedPoints = FLAGS_max_traced_points;
   settings.pointTracer.positionVariance = FLAGS_pos_variance;
   settings.trackFromLastKf = FLAGS_track_from_last_kf;
   settings.predictUsingScrew = FLAGS_predict_using_screw;
   settings.frameTracker.useGradWeighting = FLAGS_use_grad_weights_on_tracking;
   settings.frameTracker.trackFailFactor = FLAGS_track_fail_factor;
+  settings.frameTracker.useCeres = FLAGS_use_ceres_tracking;
+  settings.frameTracker.maxIterations = FLAGS_tracking_max_iter;
+  settings.frameTracker.useBilinear = FLAGS_bilinear_tracking;
   settings.bundleAdjuster.runBA = FLAGS_run_ba;
+  settings.bundleAdjuster.useCeres = FLAGS_use_ceres_ba;
+  settings.bundleAdjuster.useBilinear = FLAGS_bilinear_ba;
   settings.bundleAdjuster.fixedMotionOnFirstAdjustent =
       FLAGS_fixed_motion_on_first_ba;
   settings.pointTracer.optimizedStddev = FLAGS_optimized_stddev;
   settings.shiftBetweenKeyFrames = FLAGS_shift_between_keyframes;
+  settings.backgroundMapping = FLAGS_background_mapping;
+  settings.cameraModel.cacheDirectory = FLAGS_camera_cache_dir;
 
   return settings;
 }
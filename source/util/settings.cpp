@@ -1,10 +1,12 @@
 #include "util/settings.h"
 #include "util/defs.h"
 
+#include <glog/logging.h>
 #include <opencv2/core.hpp>
 
 namespace fishdso {
 
+const std::string Settings::CameraModel::default_cacheDirectory = "";
 const std::vector<double> Settings::PixelSelector::default_gradThresholds{
     20.0, 8.0, 5.0};
 const std::vector<cv::Scalar> Settings::PixelSelector::default_pointColors{
@@ -13,6 +15,18 @@ const StdVector<Vec2> Settings::ResidualPattern::default_pattern{
     Vec2(0, 0), Vec2(0, -2), Vec2(-1, -1), Vec2(1, -1), Vec2(-2, 0),
     Vec2(2, 0), Vec2(-1, 1), Vec2(1, 1),   Vec2(0, 2)};
 
+Settings::ResidualPattern::ResidualPattern(const StdVector<Vec2> &newPattern)
+    : _pattern(newPattern) {
+  CHECK_LE(int(_pattern.size()), max_size)
+      << "residual pattern has more than max_size pixels";
+  height = int(std::ceil(std::max_element(_pattern.begin(), _pattern.end(),
+                                          [](const Vec2 &a, const Vec2 &b) {
+                                            return a.lpNorm<Eigen::Infinity>() <
+                                                   b.lpNorm<Eigen::Infinity>();
+                                          })
+                             ->lpNorm<Eigen::Infinity>()));
+}
+
 InitializerSettings Settings::getInitializerSettings() const {
   return {delaunayDsoInitializer,
           stereoMatcher,
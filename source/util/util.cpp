@@ -7,6 +7,14 @@
 #include <opencv2/opencv.hpp>
 #include <sophus/se3.hpp>
 
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 bool validateDepthsPart(const char *flagname, double value) {
   if (value >= 0 && value <= 1)
     return true;
@@ -148,17 +156,35 @@ void putSquare(cv::Mat &img, const cv::Point &pos, int size,
                 col, thickness);
 }
 
-void grad(const cv::Mat &img, cv::Mat1d &gradX, cv::Mat1d &gradY,
-          cv::Mat1d &gradNorm) {
-  static double filter[] = {-0.5, 0.0, 0.5};
-  static cv::Mat1d gradXKer(1, 3, filter);
-  static cv::Mat1d gradYKer(3, 1, filter);
-
-  cv::filter2D(img, gradX, CV_64F, gradXKer, cv::Point(-1, -1), 0,
-               cv::BORDER_REPLICATE);
-  cv::filter2D(img, gradY, CV_64F, gradYKer, cv::Point(-1, -1), 0,
-               cv::BORDER_REPLICATE);
-  cv::magnitude(gradX, gradY, gradNorm);
+// Central differences with replicated borders. All three images are filled
+// in one pass over img.
+void grad(const cv::Mat1b &img, cv::Mat1f &gradX, cv::Mat1f &gradY,
+          cv::Mat1f &gradNorm) {
+  const int w = img.cols, h = img.rows;
+  gradX.create(h, w);
+  gradY.create(h, w);
+  gradNorm.create(h, w);
+
+  for (int y = 0; y < h; ++y) {
+    const unsigned char *row = img[y];
+    const unsigned char *up = img[std::max(y - 1, 0)];
+    const unsigned char *down = img[std::min(y + 1, h - 1)];
+    float *gx = gradX[y], *gy = gradY[y], *gn = gradNorm[y];
+
+    auto computeAt = [&](int x, int left, int right) {
+      float dx = 0.5f * (float(row[right]) - float(row[left]));
+      float dy = 0.5f * (float(down[x]) - float(up[x]));
+      gx[x] = dx;
+      gy[x] = dy;
+      gn[x] = std::sqrt(dx * dx + dy * dy);
+    };
+
+    computeAt(0, 0, std::min(1, w - 1));
+    for (int x = 1; x < w - 1; ++x)
+      computeAt(x, x - 1, x + 1);
+    if (w > 1)
+      computeAt(w - 1, w - 2, w - 1);
+  }
 }
 
 double gradNormAt(const cv::Mat1b &img, const cv::Point &p) {
@@ -212,9 +238,134 @@ cv::Point toCvPoint(const Vec2 &vec, double scaleX, double scaleY,
                    int(vec[1] * scaleY) + shift.y);
 }
 
-template cv::Mat boxFilterPyrDown<unsigned char>(const cv::Mat &img);
+void boxFilterPyrDownRow(const unsigned char *row0, const unsigned char *row1,
+                         unsigned char *dst, int dstWidth) {
+  int x = 0;
+#if defined(__SSE2__)
+  const __m128i lowBytes = _mm_set1_epi16(0x00FF);
+  // sums of the 2x2 blocks starting at 16 source pixels, as 8 uint16
+  auto blockSums = [&](int from) {
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row0 + from));
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row1 + from));
+    return _mm_add_epi16(
+        _mm_add_epi16(_mm_and_si128(a, lowBytes), _mm_srli_epi16(a, 8)),
+        _mm_add_epi16(_mm_and_si128(b, lowBytes), _mm_srli_epi16(b, 8)));
+  };
+  for (; x + 16 <= dstWidth; x += 16) {
+    __m128i lo = _mm_srli_epi16(blockSums(2 * x), 2);
+    __m128i hi = _mm_srli_epi16(blockSums(2 * x + 16), 2);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x),
+                     _mm_packus_epi16(lo, hi));
+  }
+#elif defined(__ARM_NEON)
+  for (; x + 16 <= dstWidth; x += 16) {
+    uint16x8_t lo = vpadalq_u8(vpaddlq_u8(vld1q_u8(row0 + 2 * x)),
+                               vld1q_u8(row1 + 2 * x));
+    uint16x8_t hi = vpadalq_u8(vpaddlq_u8(vld1q_u8(row0 + 2 * x + 16)),
+                               vld1q_u8(row1 + 2 * x + 16));
+    vst1q_u8(dst + x, vcombine_u8(vshrn_n_u16(lo, 2), vshrn_n_u16(hi, 2)));
+  }
+#endif
+  for (; x < dstWidth; ++x)
+    dst[x] = (int(row0[2 * x]) + row0[2 * x + 1] + row1[2 * x] +
+              row1[2 * x + 1]) /
+             4;
+}
+
+template <> cv::Mat boxFilterPyrDown<unsigned char>(const cv::Mat &img) {
+  cv::Mat1b result(img.rows / 2, img.cols / 2);
+  for (int y = 0; y < result.rows; ++y)
+    boxFilterPyrDownRow(img.ptr<unsigned char>(2 * y),
+                        img.ptr<unsigned char>(2 * y + 1), result[y],
+                        result.cols);
+  return result;
+}
+
 template cv::Mat boxFilterPyrDown<cv::Vec3b>(const cv::Mat &img);
 
+double patternEnergy(const double *intencities, const double *sampled,
+                     int patternSize, double outlierDiff) {
+  double energy = 0;
+  for (int i = 0; i < patternSize; ++i) {
+    double residual = std::abs(intencities[i] - sampled[i]);
+    energy += residual > outlierDiff
+                  ? outlierDiff * (2 * residual - outlierDiff)
+                  : residual * residual;
+  }
+  return energy;
+}
+
+// Each lane repeats the operations of patternEnergy in the same order. This
+// file is compiled without FP contraction, so no FMA can break the equality.
+void patternEnergies(const double *intencities, const double *sampled,
+                     int patternSize, int numPositions, double outlierDiff,
+                     double *energies) {
+  int k = 0;
+#if defined(__AVX__)
+  const __m256d th = _mm256_set1_pd(outlierDiff);
+  const __m256d signBit = _mm256_set1_pd(-0.0);
+  for (; k + 4 <= numPositions; k += 4) {
+    __m256d energy = _mm256_setzero_pd();
+    for (int i = 0; i < patternSize; ++i) {
+      __m256d sampledI = _mm256_loadu_pd(sampled + i * numPositions + k);
+      __m256d residual = _mm256_andnot_pd(
+          signBit, _mm256_sub_pd(_mm256_set1_pd(intencities[i]), sampledI));
+      __m256d outlier = _mm256_mul_pd(
+          th, _mm256_sub_pd(_mm256_add_pd(residual, residual), th));
+      __m256d inlier = _mm256_mul_pd(residual, residual);
+      __m256d isOutlier = _mm256_cmp_pd(residual, th, _CMP_GT_OQ);
+      energy =
+          _mm256_add_pd(energy, _mm256_blendv_pd(inlier, outlier, isOutlier));
+    }
+    _mm256_storeu_pd(energies + k, energy);
+  }
+#elif defined(__SSE2__)
+  const __m128d th = _mm_set1_pd(outlierDiff);
+  const __m128d signBit = _mm_set1_pd(-0.0);
+  for (; k + 2 <= numPositions; k += 2) {
+    __m128d energy = _mm_setzero_pd();
+    for (int i = 0; i < patternSize; ++i) {
+      __m128d sampledI = _mm_loadu_pd(sampled + i * numPositions + k);
+      __m128d residual = _mm_andnot_pd(
+          signBit, _mm_sub_pd(_mm_set1_pd(intencities[i]), sampledI));
+      __m128d outlier =
+          _mm_mul_pd(th, _mm_sub_pd(_mm_add_pd(residual, residual), th));
+      __m128d inlier = _mm_mul_pd(residual, residual);
+      __m128d isOutlier = _mm_cmpgt_pd(residual, th);
+      energy = _mm_add_pd(energy, _mm_or_pd(_mm_and_pd(isOutlier, outlier),
+                                            _mm_andnot_pd(isOutlier, inlier)));
+    }
+    _mm_storeu_pd(energies + k, energy);
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  const float64x2_t th = vdupq_n_f64(outlierDiff);
+  for (; k + 2 <= numPositions; k += 2) {
+    float64x2_t energy = vdupq_n_f64(0);
+    for (int i = 0; i < patternSize; ++i) {
+      float64x2_t sampledI = vld1q_f64(sampled + i * numPositions + k);
+      float64x2_t residual = vabdq_f64(vdupq_n_f64(intencities[i]), sampledI);
+      float64x2_t outlier =
+          vmulq_f64(th, vsubq_f64(vaddq_f64(residual, residual), th));
+      float64x2_t inlier = vmulq_f64(residual, residual);
+      uint64x2_t isOutlier = vcgtq_f64(residual, th);
+      energy = vaddq_f64(energy, vbslq_f64(isOutlier, outlier, inlier));
+    }
+    vst1q_f64(energies + k, energy);
+  }
+#endif
+  for (; k < numPositions; ++k) {
+    double energy = 0;
+    for (int i = 0; i < patternSize; ++i) {
+      double residual =
+          std::abs(intencities[i] - sampled[i * numPositions + k]);
+      energy += residual > outlierDiff
+                    ? outlierDiff * (2 * residual - outlierDiff)
+                    : residual * residual;
+    }
+    energies[k] = energy;
+  }
+}
+
 cv::Mat1b cvtBgrToGray(const cv::Mat &coloredImg) {
   cv::Mat result;
   cv::cvtColor(coloredImg, result, cv::COLOR_BGR2GRAY);
@@ -235,31 +386,6 @@ cv::Mat3b cvtGrayToBgr(const cv::Mat1b &grayImg) {
   return result;
 }
 
-cv::Mat1d pyrNUpDepth(const cv::Mat1d &integralWeightedDepths,
-                      const cv::Mat1d &integralWeights, int levelNum) {
-  cv::Mat1d res = cv::Mat1d((integralWeightedDepths.rows - 1) >> levelNum,
-                            (integralWeightedDepths.cols - 1) >> levelNum);
-  int d = (1 << levelNum);
-
-  for (int y = 0; y < res.rows; ++y)
-    for (int x = 0; x < res.cols; ++x) {
-      int origX = x << levelNum, origY = y << levelNum;
-      float depthsSum = integralWeightedDepths(origY + d, origX + d) -
-                        integralWeightedDepths(origY, origX + d) -
-                        integralWeightedDepths(origY + d, origX) +
-                        integralWeightedDepths(origY, origX);
-      float weightsSum = integralWeights(origY + d, origX + d) -
-                         integralWeights(origY, origX + d) -
-                         integralWeights(origY + d, origX) +
-                         integralWeights(origY, origX);
-      if (std::abs(weightsSum) > 1e-8)
-        res(y, x) = depthsSum / weightsSum;
-      else
-        res(y, x) = -1;
-    }
-  return res;
-}
-
 cv::Mat3b drawDepthedFrame(const cv::Mat1b &frame, const cv::Mat1d &depths,
                            double minDepth, double maxDepth) {
   int w = frame.cols, h = frame.rows;
@@ -0,0 +1,73 @@
+#ifndef INCLUDE_PLANESCENE
+#define INCLUDE_PLANESCENE
+
+#include "system/CameraModel.h"
+#include "util/DepthedImagePyramid.h"
+#include "util/types.h"
+#include <cmath>
+#include <memory>
+#include <opencv2/core.hpp>
+
+namespace fishdso {
+
+// A textured plane z = planeDepth in the world frame, seen by a pinhole
+// camera. Frames are rendered exactly, so the tests know the true motions and
+// depths.
+struct PlaneScene {
+  static constexpr int width = 640, height = 480;
+  static constexpr double planeDepth = 5;
+
+  PlaneScene()
+      : cam(width, height, 400, 320, 240) {}
+
+  static double texture(double x, double y) {
+    const double twoPi = 2 * M_PI;
+    return 128 + 40 * std::sin(twoPi * x / 1.7) * std::sin(twoPi * y / 1.3) +
+           30 * std::sin(twoPi * (x + y) / 0.9) +
+           20 * std::cos(twoPi * (x - 2 * y) / 3.1);
+  }
+
+  // distance to the plane along the ray of the pixel p of the frame
+  double depth(const SE3 &frameToWorld, const Vec2 &p) const {
+    Vec3 rayInWorld = frameToWorld.so3() * cam.unmapUnit(p);
+    return (planeDepth - frameToWorld.translation()[2]) / rayInWorld[2];
+  }
+
+  // position of the plane point seen in the pixel p of the world frame
+  Vec3 basePos(const Vec2 &p) const {
+    return cam.unmapUnit(p) * depth(SE3(), p);
+  }
+
+  cv::Mat1b render(const SE3 &worldToFrame) const {
+    const SE3 frameToWorld = worldToFrame.inverse();
+    cv::Mat1b frame(height, width);
+    for (int y = 0; y < height; ++y)
+      for (int x = 0; x < width; ++x) {
+        Vec2 p(x, y);
+        Vec3 pos = frameToWorld * (cam.unmapUnit(p) * depth(frameToWorld, p));
+        frame(y, x) = cv::saturate_cast<uchar>(texture(pos[0], pos[1]));
+      }
+    return frame;
+  }
+
+  // the world frame with the true depths of every other pixel
+  std::unique_ptr<DepthedImagePyramid> baseFrame(int levelNum) const {
+    const int step = 2;
+    StdVector<Vec2> points;
+    std::vector<double> depths;
+    for (int y = 0; y < height; y += step)
+      for (int x = 0; x < width; x += step) {
+        points.push_back(Vec2(x, y));
+        depths.push_back(depth(SE3(), points.back()));
+      }
+    std::vector<double> weights(points.size(), 1.0);
+    return std::unique_ptr<DepthedImagePyramid>(new DepthedImagePyramid(
+        render(SE3()), levelNum, points, depths, weights));
+  }
+
+  CameraModel cam;
+};
+
+} // namespace fishdso
+
+#endif
@@ -0,0 +1,335 @@
+#include "DirectResidual.h"
+#include "PlaneScene.h"
+#include "system/CeresBundleAdjuster.h"
+#include "system/KeyFrame.h"
+#include "system/SlidingWindowBundleAdjuster.h"
+#include "util/util.h"
+#include <Eigen/Dense>
+#include <ceres/gradient_checker.h>
+#include <ceres/local_parameterization.h>
+#include <gtest/gtest.h>
+#include <random>
+
+namespace fishdso {
+
+class SlidingWindowBundleAdjusterTest : public ::testing::Test {
+protected:
+  static constexpr int frameParams = SlidingWindowBundleAdjuster::frameParams;
+
+  // the first keyframe is the world frame
+  SlidingWindowBundleAdjusterTest()
+      : frameToWorld{SE3(),
+                     SE3(SO3::exp(Vec3(0.01, -0.02, 0.01)),
+                         Vec3(0.3, 0.05, 0.1)),
+                     SE3(SO3::exp(Vec3(-0.01, 0.015, 0.02)),
+                         Vec3(0.1, -0.25, 0.2))} {}
+
+  // Keyframes at the true poses with the true depths of a grid of points. If
+  // perturbed, the depths and all the keyframes but the first one are moved
+  // off the truth, the same way on each call. The distance between the first
+  // two keyframes is kept, as it fixes the scale.
+  std::vector<std::unique_ptr<KeyFrame>> makeWindow(bool perturbed) {
+    std::mt19937 mt(42);
+    std::normal_distribution<double> noise(0, 1);
+    const int step = 32, margin = 16;
+
+    std::vector<std::unique_ptr<KeyFrame>> window;
+    for (int k = 0; k < frameToWorld.size(); ++k) {
+      std::shared_ptr<PreKeyFrame> preKeyFrame(new PreKeyFrame(
+          nullptr, &scene.cam,
+          cvtGrayToBgr(scene.render(frameToWorld[k].inverse())), k));
+      std::unique_ptr<KeyFrame> keyFrame(new KeyFrame(preKeyFrame));
+      keyFrame->thisToWorld = frameToWorld[k];
+      for (int y = margin; y < PlaneScene::height - margin; y += step)
+        for (int x = margin; x < PlaneScene::width - margin; x += step) {
+          Vec2 p(x, y);
+          double depth = scene.depth(frameToWorld[k], p);
+          if (perturbed)
+            depth *= std::exp(0.03 * noise(mt));
+          keyFrame->optimizedPoints.emplace_back(new OptimizedPoint(p));
+          keyFrame->optimizedPoints.back()->activate(depth);
+        }
+      window.push_back(std::move(keyFrame));
+    }
+
+    if (perturbed) {
+      const SE3 &second = frameToWorld[1], &third = frameToWorld[2];
+      window[1]->thisToWorld =
+          SE3(SO3::exp(Vec3(0.003, -0.002, 0.002)) * second.so3(),
+              SO3::exp(Vec3(0, 0, 0.02)) * second.translation());
+      window[2]->thisToWorld =
+          SE3(SO3::exp(Vec3(-0.002, 0.003, -0.002)) * third.so3(),
+              third.translation() + Vec3(0.01, -0.01, 0.01));
+    }
+    return window;
+  }
+
+  static void updatePoints(SlidingWindowBundleAdjuster &ba) {
+    ba.updatePoints();
+  }
+  static double priorEnergy(const SlidingWindowBundleAdjuster &ba) {
+    return ba.priorEnergy();
+  }
+  static const MatXX &priorH(const SlidingWindowBundleAdjuster &ba) {
+    return ba.priorH;
+  }
+  static const VecX &priorB(const SlidingWindowBundleAdjuster &ba) {
+    return ba.priorB;
+  }
+  static MatXX freeParamsBasis(const SlidingWindowBundleAdjuster &ba) {
+    return ba.freeParamsBasis();
+  }
+  static void applyStep(SlidingWindowBundleAdjuster &ba,
+                        const VecX &framesStep, const VecX &depthsStep) {
+    ba.applyStep(framesStep, depthsStep);
+  }
+
+  // Dense normal equations over [all keyframes, depths] of the points hosted
+  // in keyFrame, as they are before the keyframe is marginalized.
+  static void linearizeHosted(const SlidingWindowBundleAdjuster &ba,
+                              const KeyFrame *keyFrame, MatXX &H, VecX &b) {
+    std::vector<SlidingWindowBundleAdjuster::Point *> hosted;
+    for (const auto &point : ba.points)
+      if (point->baseFrame == keyFrame && !point->refFrames.empty())
+        hosted.push_back(point.get());
+    SlidingWindowBundleAdjuster::System system;
+    ba.linearize(hosted, system);
+
+    const int frameDim = system.H.rows(), depthDim = hosted.size();
+    H.setZero(frameDim + depthDim, frameDim + depthDim);
+    H.topLeftCorner(frameDim, frameDim) = system.H;
+    H.topRightCorner(frameDim, depthDim) = system.Hfd;
+    H.bottomLeftCorner(depthDim, frameDim) = system.Hfd.transpose();
+    H.bottomRightCorner(depthDim, depthDim) = system.Hdd.asDiagonal();
+    b.resize(frameDim + depthDim);
+    b << system.b, system.bd;
+  }
+
+  PlaneScene scene;
+  StdVector<SE3> frameToWorld;
+};
+
+TEST_F(SlidingWindowBundleAdjusterTest, LevenbergMarquardtMatchesCeres) {
+  BundleAdjusterSettings settings;
+  const int maxIterations = 50;
+
+  // the windows outlive the adjusters, which refer to their parameters
+  auto lmWindow = makeWindow(true);
+  auto ceresWindow = makeWindow(true);
+  SlidingWindowBundleAdjuster lm(&scene.cam, settings);
+  CeresBundleAdjuster ceres(&scene.cam, settings);
+  for (int k = 0; k < frameToWorld.size(); ++k) {
+    lm.addKeyFrame(lmWindow[k].get());
+    ceres.addKeyFrame(ceresWindow[k].get());
+  }
+  lm.adjust(maxIterations);
+  ceres.adjust(maxIterations);
+
+  double sqDepthDiff = 0;
+  int pointsNum = 0;
+  for (int k = 0; k < frameToWorld.size(); ++k) {
+    const KeyFrame &lmKf = *lmWindow[k], &ceresKf = *ceresWindow[k];
+    SE3 diff = lmKf.thisToWorld * ceresKf.thisToWorld.inverse();
+    EXPECT_LT(diff.translation().norm(), 2e-3) << "kf #" << k;
+    EXPECT_LT(diff.so3().log().norm(), 1e-3) << "kf #" << k;
+
+    // and both of them are near the truth
+    SE3 err = lmKf.thisToWorld * frameToWorld[k].inverse();
+    EXPECT_LT(err.translation().norm(), 1e-2) << "kf #" << k;
+    EXPECT_LT(err.so3().log().norm(), 2e-3) << "kf #" << k;
+
+    for (int i = 0; i < lmKf.optimizedPoints.size(); ++i) {
+      double d = lmKf.optimizedPoints[i]->logInvDepth -
+                 ceresKf.optimizedPoints[i]->logInvDepth;
+      sqDepthDiff += d * d;
+      ++pointsNum;
+    }
+  }
+  EXPECT_LT(std::sqrt(sqDepthDiff / pointsNum), 5e-3);
+}
+
+TEST_F(SlidingWindowBundleAdjusterTest, PriorMatchesDenseSchurComplement) {
+  BundleAdjusterSettings settings;
+  // otherwise the light parameters of the system are singular
+  settings.affineLight.optimizeAffineLight = true;
+
+  auto window = makeWindow(true);
+  SlidingWindowBundleAdjuster ba(&scene.cam, settings);
+  for (const auto &keyFrame : window)
+    ba.addKeyFrame(keyFrame.get());
+  updatePoints(ba);
+
+  MatXX H;
+  VecX b;
+  linearizeHosted(ba, window[0].get(), H, b);
+
+  // the first keyframe and the depths of its points are eliminated
+  const int restDim = frameParams * (window.size() - 1);
+  std::vector<int> rest, marg;
+  for (int i = 0; i < H.rows(); ++i)
+    (i >= frameParams && i < frameParams + restDim ? rest : marg).push_back(i);
+  auto block = [&](const std::vector<int> &rows,
+                   const std::vector<int> &cols) {
+    MatXX result(rows.size(), cols.size());
+    for (int i = 0; i < rows.size(); ++i)
+      for (int j = 0; j < cols.size(); ++j)
+        result(i, j) = H(rows[i], cols[j]);
+    return result;
+  };
+  auto segment = [&](const std::vector<int> &indices) {
+    VecX result(indices.size());
+    for (int i = 0; i < indices.size(); ++i)
+      result[i] = b[indices[i]];
+    return result;
+  };
+  MatXX HrmHmmInv = block(rest, marg) * block(marg, marg).inverse();
+  MatXX schurH = block(rest, rest) - HrmHmmInv * block(marg, rest);
+  VecX schurB = segment(rest) - HrmHmmInv * segment(marg);
+
+  ba.marginalizeKeyFrame(window[0].get());
+  ASSERT_EQ(priorH(ba).rows(), restDim);
+  EXPECT_LT((priorH(ba) - schurH).norm(), 1e-6 * schurH.norm());
+  EXPECT_LT((priorB(ba) - schurB).norm(), 1e-6 * schurB.norm());
+
+  // the prior is the quadratic model of the eliminated energy around the
+  // marginalization point
+  std::mt19937 mt;
+  std::normal_distribution<double> noise(0, 1e-2);
+  VecX delta(restDim);
+  for (int i = 0; i < restDim; ++i)
+    delta[i] = noise(mt);
+  for (int k = 1; k < window.size(); ++k) {
+    KeyFrame &kf = *window[k];
+    const auto step = delta.segment<frameParams>(frameParams * (k - 1));
+    kf.thisToWorld = SE3(SO3::exp(step.segment<3>(3)) * kf.thisToWorld.so3(),
+                         kf.thisToWorld.translation() + step.head<3>());
+    kf.lightWorldToThis.data[0] += step[6];
+    kf.lightWorldToThis.data[1] += step[7];
+  }
+  double linearTerm = delta.dot(schurB);
+  double quadraticTerm = 0.5 * delta.dot(schurH * delta);
+  EXPECT_NEAR(priorEnergy(ba), linearTerm + quadraticTerm,
+              1e-6 * (std::abs(linearTerm) + std::abs(quadraticTerm)));
+}
+
+TEST_F(SlidingWindowBundleAdjusterTest, StepKeepsTheGauge) {
+  BundleAdjusterSettings settings;
+  auto window = makeWindow(true);
+  SlidingWindowBundleAdjuster ba(&scene.cam, settings);
+  for (const auto &keyFrame : window)
+    ba.addKeyFrame(keyFrame.get());
+
+  // two directions on the sphere and the rotation of the second keyframe,
+  // the motion of the third one, no affine light
+  MatXX basis = freeParamsBasis(ba);
+  ASSERT_EQ(basis.rows(), frameParams * window.size());
+  ASSERT_EQ(basis.cols(), 2 + 3 + 6);
+  EXPECT_EQ(basis.topRows<frameParams>().norm(), 0);
+
+  const Vec3 center = window[0]->thisToWorld.translation();
+  const double radius = (window[1]->thisToWorld.translation() - center).norm();
+  const Vec3 radial =
+      (window[1]->thisToWorld.translation() - center).normalized();
+  for (int c = 0; c < basis.cols(); ++c)
+    EXPECT_NEAR(radial.dot(basis.block<3, 1>(frameParams, c)), 0, 1e-12);
+
+  const SE3 firstToWorld = window[0]->thisToWorld;
+  const AffineLightTransform<double> firstLight = window[0]->lightWorldToThis;
+  std::mt19937 mt;
+  std::normal_distribution<double> noise(0, 0.05);
+  for (int it = 0; it < 10; ++it) {
+    VecX free(basis.cols());
+    for (int i = 0; i < free.size(); ++i)
+      free[i] = noise(mt);
+    applyStep(ba, basis * free, VecX());
+
+    EXPECT_EQ(window[0]->thisToWorld.matrix3x4(), firstToWorld.matrix3x4());
+    EXPECT_EQ(window[0]->lightWorldToThis.data[0], firstLight.data[0]);
+    EXPECT_EQ(window[0]->lightWorldToThis.data[1], firstLight.data[1]);
+    EXPECT_NEAR((window[1]->thisToWorld.translation() - center).norm(),
+                radius, 1e-12);
+  }
+}
+
+TEST(CeresBundleAdjusterTest, DirectResidualMatchesNumericDiff) {
+  PlaneScene scene;
+  const SE3 baseToWorld;
+  const SE3 refToWorld(SO3::exp(Vec3(0.01, -0.02, 0.01)), Vec3(0.3, 0.05, 0.1));
+  KeyFrame base(std::shared_ptr<PreKeyFrame>(new PreKeyFrame(
+      nullptr, &scene.cam, cvtGrayToBgr(scene.render(baseToWorld.inverse())),
+      0)));
+  KeyFrame ref(std::shared_ptr<PreKeyFrame>(new PreKeyFrame(
+      nullptr, &scene.cam, cvtGrayToBgr(scene.render(refToWorld.inverse())),
+      1)));
+  base.thisToWorld = baseToWorld;
+  ref.thisToWorld = refToWorld;
+
+  const StdVector<Vec2> &pattern = Settings::ResidualPattern().pattern();
+  const double outlierDiff = Settings::Intencity::default_outlierDiff;
+
+  ceres::EigenQuaternionParameterization quaternionParameterization;
+  std::vector<const ceres::LocalParameterization *> parameterizations = {
+      nullptr, nullptr, &quaternionParameterization, nullptr,
+      &quaternionParameterization, nullptr, nullptr};
+  ceres::NumericDiffOptions diffOptions;
+
+  std::mt19937 mt;
+  std::uniform_real_distribution<double> xs(100, PlaneScene::width - 100);
+  std::uniform_real_distribution<double> ys(100, PlaneScene::height - 100);
+  std::uniform_real_distribution<double> weightDist(0.2, 1.0);
+  std::uniform_real_distribution<double> lightA(-0.05, 0.05);
+  // wide enough for the residuals to fall on both sides of outlierDiff
+  std::uniform_real_distribution<double> lightB(-20, 20);
+  std::normal_distribution<double> noise(0, 1);
+
+  const int testCount = 50;
+  for (int it = 0; it < testCount; ++it) {
+    Vec2 p(xs(mt), ys(mt));
+    OptimizedPoint op(p);
+    op.activate(scene.depth(baseToWorld, p) * std::exp(0.05 * noise(mt)));
+    std::vector<double> weights(pattern.size());
+    for (double &w : weights)
+      w = weightDist(mt);
+    DirectResidual residual(&base.preKeyFrame->internals->interpolator(0),
+                            &ref.preKeyFrame->internals->interpolator(0),
+                            &scene.cam, &op, pattern, weights, outlierDiff,
+                            &base, &ref);
+
+    // a random state near the true one
+    auto perturbed = [&](const SE3 &motion) {
+      Vec3 rot(noise(mt), noise(mt), noise(mt));
+      Vec3 trans(noise(mt), noise(mt), noise(mt));
+      return SE3(SO3::exp(0.005 * rot) * motion.so3(),
+                 motion.translation() + 0.01 * trans);
+    };
+    double logInvDepth = op.logInvDepth;
+    SE3 baseState = perturbed(baseToWorld), refState = perturbed(refToWorld);
+    double baseAff[] = {lightA(mt), lightB(mt)};
+    double refAff[] = {lightA(mt), lightB(mt)};
+    const double *parameters[] = {&logInvDepth,
+                                  baseState.translation().data(),
+                                  baseState.so3().data(),
+                                  refState.translation().data(),
+                                  refState.so3().data(),
+                                  baseAff,
+                                  refAff};
+
+    // Single entries of the Jacobians may be arbitrarily close to zero where
+    // the image gradient vanishes, so whole blocks are compared instead of
+    // the entry-wise relative errors of the checker.
+    ceres::GradientChecker checker(&residual, &parameterizations, diffOptions);
+    ceres::GradientChecker::ProbeResults results;
+    checker.Probe(parameters, 1e-5, &results);
+    ASSERT_TRUE(results.return_value);
+    for (int i = 0; i < results.local_jacobians.size(); ++i) {
+      const ceres::Matrix &analytic = results.local_jacobians[i];
+      const ceres::Matrix &numeric = results.local_numeric_jacobians[i];
+      EXPECT_LT((analytic - numeric).norm(), 1e-4 * numeric.norm() + 1e-9)
+          << "parameter block #" << i << "\nanalytic:\n"
+          << analytic << "\nnumeric:\n"
+          << numeric;
+    }
+  }
+}
+
+} // namespace fishdso
@@ -1,11 +1,27 @@
 #include "system/CameraModel.h"
 #include "system/DsoSystem.h"
+#include "system/ImmaturePoint.h"
+#include "system/Undistorter.h"
 #include "util/types.h"
 #include <Eigen/Core>
+#include <ceres/jet.h>
+#include <chrono>
 #include <gtest/gtest.h>
 
 using namespace fishdso;
 
+// the real-world calibration shared by the tests below
+CameraModel makeTestCamera(int width = 1920, int height = 1208,
+                           const Settings::CameraModel &settings = {}) {
+  double scale = 604.0;
+  Vec2 center(1.58447, 1.07353);
+  int unmapPolyDeg = 7;
+  VecX unmapPolyCoeffs(unmapPolyDeg, 1);
+  unmapPolyCoeffs << 1.14544, -0.146714, -0.967996, 2.13329, -2.42001, 1.33018,
+      -0.292722;
+  return CameraModel(width, height, scale, center, unmapPolyCoeffs, settings);
+}
+
 TEST(CameraModelTest, CoreanCameraReprojection) {
   // some real-world data
   double scale = 604.0;
@@ -60,15 +76,9 @@ TEST(CameraModelTest, SolelyPolynomial) {
 }
 
 TEST(CameraModelTest, CamerasPyramid) {
-  double scale = 604.0;
-  Vec2 center(1.58447, 1.07353);
-  int unmapPolyDeg = 7;
   int pyrLevels = 6;
-  VecX unmapPolyCoeffs(unmapPolyDeg, 1);
-  unmapPolyCoeffs << 1.14544, -0.146714, -0.967996, 2.13329, -2.42001, 1.33018,
-      -0.292722;
   int width = 1920, height = 1208;
-  CameraModel cam(width, height, scale, center, unmapPolyCoeffs);
+  CameraModel cam = makeTestCamera(width, height);
   StdVector<CameraModel> camPyr = cam.camPyr(pyrLevels);
 
   std::mt19937 mt;
@@ -93,6 +103,245 @@ TEST(CameraModelTest, CamerasPyramid) {
     }
 }
 
+TEST(CameraModelTest, RayTable) {
+  int pyrLevels = 3;
+  int width = 1920, height = 1208;
+  CameraModel cam = makeTestCamera(width, height);
+  StdVector<CameraModel> camPyr = cam.camPyr(pyrLevels);
+
+  std::mt19937 mt;
+  const int testCount = 1000;
+  for (int lvl = 0; lvl < pyrLevels; ++lvl) {
+    std::uniform_real_distribution<> xs(0, camPyr[lvl].getWidth());
+    std::uniform_real_distribution<> ys(0, camPyr[lvl].getHeight());
+    for (int it = 0; it < testCount; ++it) {
+      Vec2 pnt(xs(mt), ys(mt));
+      Vec3 exact = camPyr[lvl].unmap(pnt).normalized();
+      Vec3 fromTable = camPyr[lvl].unmapUnit(pnt);
+      EXPECT_NEAR(fromTable.norm(), 1.0, 1e-4);
+      double angle = (180.0 / M_PI) *
+                     std::atan2(exact.cross(fromTable).norm(),
+                                exact.dot(fromTable));
+      EXPECT_LT(angle, 0.01);
+    }
+  }
+}
+
+TEST(CameraModelTest, BatchProjection) {
+  int width = 1920, height = 1208;
+  CameraModel cam = makeTestCamera(width, height);
+
+  std::mt19937 mt;
+  std::uniform_real_distribution<> xs(0, width);
+  std::uniform_real_distribution<> ys(0, height);
+  std::uniform_real_distribution<> depths(0.1, 10.0);
+
+  const int testCount = 1000;
+  StdVector<Vec2> points;
+  for (int it = 0; it < testCount; ++it)
+    points.push_back(Vec2(xs(mt), ys(mt)));
+  points.push_back(cam.getImgCenter());
+
+  StdVector<Vec3> rays;
+  cam.unmapBatch(points, rays);
+  ASSERT_EQ(rays.size(), points.size());
+  for (int i = 0; i < points.size(); ++i) {
+    EXPECT_LT((rays[i] - cam.unmap(points[i])).norm(), 1e-9);
+    rays[i] *= depths(mt);
+  }
+
+  StdVector<Vec2> mapped;
+  cam.mapBatch(rays, mapped);
+  ASSERT_EQ(mapped.size(), rays.size());
+  for (int i = 0; i < rays.size(); ++i)
+    EXPECT_LT((mapped[i] - cam.map(rays[i])).norm(), 1e-9);
+}
+
+TEST(CameraModelTest, DiffMapMatchesJet) {
+  int width = 1920, height = 1208;
+  CameraModel cam = makeTestCamera(width, height);
+
+  std::mt19937 mt;
+  std::uniform_real_distribution<> xs(0, width);
+  std::uniform_real_distribution<> ys(0, height);
+  std::uniform_real_distribution<> depths(0.1, 10.0);
+
+  const int testCount = 10000;
+  StdVector<Vec3> rays;
+  for (int it = 0; it < testCount; ++it)
+    rays.push_back(depths(mt) * cam.unmap(Vec2(xs(mt), ys(mt))));
+
+  typedef ceres::Jet<double, 3> Jet3;
+  StdVector<std::pair<Vec2, Mat23>> jetResults;
+  auto jetStart = std::chrono::steady_clock::now();
+  for (const Vec3 &ray : rays) {
+    Jet3 rayJet[3];
+    for (int i = 0; i < 3; ++i)
+      rayJet[i] = Jet3(ray[i], i);
+    Eigen::Matrix<Jet3, 2, 1> pointJet = cam.map(rayJet);
+    Mat23 jacobian;
+    jacobian << pointJet[0].v.transpose(), pointJet[1].v.transpose();
+    jetResults.push_back({Vec2(pointJet[0].a, pointJet[1].a), jacobian});
+  }
+  auto jetEnd = std::chrono::steady_clock::now();
+
+  StdVector<std::pair<Vec2, Mat23>> results;
+  auto start = std::chrono::steady_clock::now();
+  for (const Vec3 &ray : rays)
+    results.push_back(cam.diffMap(ray));
+  auto end = std::chrono::steady_clock::now();
+
+  std::cout << "diffMap with Jet: "
+            << std::chrono::duration<double, std::micro>(jetEnd - jetStart)
+                       .count() /
+                   testCount
+            << " us, closed-form: "
+            << std::chrono::duration<double, std::micro>(end - start).count() /
+                   testCount
+            << " us" << std::endl;
+
+  for (int i = 0; i < testCount; ++i) {
+    EXPECT_LT((results[i].first - jetResults[i].first).norm(), 1e-8);
+    EXPECT_LT((results[i].second - jetResults[i].second).norm(),
+              1e-8 * std::max(1.0, jetResults[i].second.norm()));
+  }
+}
+
+TEST(CameraModelTest, AffinePatternReprojection) {
+  CameraModel cam = makeTestCamera();
+  const StdVector<Vec2> &pattern = Settings::ResidualPattern().pattern();
+  const int patternSize = pattern.size();
+
+  std::mt19937 mt;
+  std::uniform_real_distribution<> xs(50, cam.getWidth() - 50);
+  std::uniform_real_distribution<> ys(50, cam.getHeight() - 50);
+  std::uniform_real_distribution<> depths(1.0, 10.0);
+  std::normal_distribution<> coord;
+
+  const int testCount = 1000;
+  int tested = 0;
+  for (int it = 0; it < testCount; ++it) {
+    Vec3 rotation(coord(mt), coord(mt), coord(mt));
+    Vec3 translation(coord(mt), coord(mt), coord(mt));
+    SE3 baseToRef(SO3::exp(0.05 * rotation), 0.1 * translation.normalized());
+
+    Vec2 pnt(xs(mt), ys(mt));
+    std::array<Vec3, ImmaturePoint::MPS> baseDirections;
+    for (int i = 0; i < patternSize; ++i)
+      baseDirections[i] = cam.unmap(Vec2(pnt + pattern[i])).normalized();
+    double depth = depths(mt);
+    Vec2 point = cam.map(Vec3(baseToRef * (depth * baseDirections[0])));
+    if (!cam.isOnImage(point, 0))
+      continue;
+    tested++;
+
+    ImmaturePoint::PatternReprojector reprojector(cam, baseToRef,
+                                                  baseDirections, patternSize);
+    std::array<Vec2, ImmaturePoint::MPS> reproj;
+    reprojector.reproject(point, depth, reproj);
+    for (int i = 0; i < patternSize; ++i) {
+      Vec2 exact = cam.map(Vec3(baseToRef * (depth * baseDirections[i])));
+      EXPECT_LT((reproj[i] - exact).norm(), 0.02);
+    }
+  }
+  EXPECT_GT(tested, testCount / 2);
+}
+
+TEST(CameraModelTest, FocalLengthCameras) {
+  int width = 1280, height = 1024;
+  double f = 500, cx = 640, cy = 512;
+  std::mt19937 mt;
+  std::uniform_real_distribution<> xs(0, width);
+  std::uniform_real_distribution<> ys(0, height);
+  std::uniform_real_distribution<> depths(0.1, 10.0);
+
+  for (CameraModel::Type type :
+       {CameraModel::PINHOLE, CameraModel::EQUIDISTANT}) {
+    CameraModel cam(width, height, f, cx, cy, type);
+    EXPECT_EQ(cam.getType(), type);
+    EXPECT_LT((cam.getImgCenter() - Vec2(cx, cy)).norm(), 1e-9);
+
+    const int testCount = 1000;
+    for (int it = 0; it < testCount; ++it) {
+      Vec2 pnt(xs(mt), ys(mt));
+      Vec3 ray = depths(mt) * cam.unmap(pnt);
+      EXPECT_LT((cam.map(ray) - pnt).norm(), 1e-6);
+
+      auto [mapped, jacobian] = cam.diffMap(ray);
+      EXPECT_LT((mapped - pnt).norm(), 1e-6);
+      Mat23 numJacobian;
+      for (int i = 0; i < 3; ++i) {
+        Vec3 delta = Vec3::Zero();
+        delta[i] = 1e-6 * ray.norm();
+        numJacobian.col(i) =
+            (cam.map(Vec3(ray + delta)) - cam.map(Vec3(ray - delta))) /
+            (2 * delta[i]);
+      }
+      EXPECT_LT((numJacobian - jacobian).norm(), 1e-4 * jacobian.norm());
+    }
+
+    // the distance to the center is proportional to the angle
+    if (type == CameraModel::EQUIDISTANT) {
+      Vec3 ray = cam.unmap(Vec2(cx + f, cy));
+      EXPECT_NEAR(std::atan2(ray[0], ray[2]), 1.0, 1e-9);
+    }
+  }
+}
+
+TEST(CameraModelTest, CalibrationCache) {
+  int width = 640, height = 403;
+
+  fs::path cacheDir = fs::temp_directory_path() / "fishdso_test_camera_cache";
+  fs::remove_all(cacheDir);
+  Settings::CameraModel settings;
+  settings.cacheDirectory = cacheDir.string();
+
+  CameraModel fitted = makeTestCamera(width, height, settings);
+  ASSERT_FALSE(fs::is_empty(cacheDir));
+  CameraModel cached = makeTestCamera(width, height, settings);
+  CameraModel uncached = makeTestCamera(width, height);
+
+  std::mt19937 mt;
+  std::uniform_real_distribution<> xs(0, width);
+  std::uniform_real_distribution<> ys(0, height);
+  const int testCount = 1000;
+  for (int it = 0; it < testCount; ++it) {
+    Vec2 pnt(xs(mt), ys(mt));
+    Vec3 ray = cached.unmap(pnt);
+    EXPECT_EQ(ray, fitted.unmap(pnt));
+    EXPECT_EQ(ray, uncached.unmap(pnt));
+    EXPECT_EQ(cached.map(ray), fitted.map(ray));
+    EXPECT_EQ(cached.map(ray), uncached.map(ray));
+    EXPECT_EQ(cached.unmapUnit(pnt), fitted.unmapUnit(pnt));
+  }
+
+  fs::remove_all(cacheDir);
+}
+
+TEST(CameraModelTest, UndistortPinhole) {
+  int width = 640, height = 480;
+  double f = 400, cx = 320, cy = 240;
+  CameraModel cam(width, height, f, cx, cy);
+  Mat33 K;
+  K << f, 0, cx, 0, f, cy, 0, 0, 1;
+
+  // undistorting a pinhole image into the same camera matrix is the identity
+  cv::Mat1b img(height, width);
+  for (int y = 0; y < height; ++y)
+    for (int x = 0; x < width; ++x)
+      img(y, x) = (x + y) / 5;
+  Undistorter undistorter(cam, K);
+  cv::Mat1b undistorted = undistorter.undistort(img);
+  ASSERT_EQ(undistorted.size(), img.size());
+
+  int mismatched = 0;
+  for (int y = 1; y < height - 1; ++y)
+    for (int x = 1; x < width - 1; ++x)
+      if (std::abs(int(undistorted(y, x)) - int(img(y, x))) > 1)
+        mismatched++;
+  EXPECT_EQ(mismatched, 0);
+}
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
@@ -0,0 +1,168 @@
+#include "PlaneScene.h"
+#include "PreKeyFrameInternals.h"
+#include "TrackingEnergy.h"
+#include "system/FrameTracker.h"
+#include "system/PreKeyFrame.h"
+#include "util/util.h"
+#include <gtest/gtest.h>
+#include <random>
+
+using namespace fishdso;
+
+TEST(TrackingTest, ResidualJacobianMatchesCentralDifferences) {
+  PlaneScene scene;
+  const CameraModel &cam = scene.cam;
+  const SE3 baseToTracked(SO3::exp(Vec3(0.01, -0.02, 0.015)),
+                          Vec3(0.1, -0.05, 0.2));
+  PreKeyFrame frame(nullptr, &scene.cam,
+                    cvtGrayToBgr(scene.render(baseToTracked)), 0);
+  const PaddedInterpolator &tracked = frame.internals->paddedInterpolator(0);
+
+  const double lightA = 0.05, lightB = 3;
+  std::mt19937 mt;
+  std::uniform_real_distribution<double> xs(100, PlaneScene::width - 100);
+  std::uniform_real_distribution<double> ys(100, PlaneScene::height - 100);
+  std::uniform_real_distribution<double> intencities(0, 255);
+
+  ASSERT_EQ(cam.getType(), CameraModel::PINHOLE);
+  auto residual = [&](const SE3 &motion, double a, double b, const Vec3 &pos,
+                      double intencity, Vec8 *J) {
+    double res = 0;
+    bool onImage = trackingResidual<CameraModel::PINHOLE>(
+        cam, tracked, motion.rotationMatrix(), motion.translation(),
+        std::exp(a), b, pos, intencity, &res, J);
+    EXPECT_TRUE(onImage);
+    return res;
+  };
+
+  const double h = 1e-7;
+  const int testCount = 200;
+  for (int it = 0; it < testCount; ++it) {
+    Vec3 pos = scene.basePos(Vec2(xs(mt), ys(mt)));
+    double intencity = intencities(mt);
+
+    Vec8 J;
+    residual(baseToTracked, lightA, lightB, pos, intencity, &J);
+
+    Vec8 numJ;
+    for (int k = 0; k < 6; ++k) {
+      SE3::Tangent delta = SE3::Tangent::Zero();
+      delta[k] = h;
+      numJ[k] = (residual(SE3::exp(delta) * baseToTracked, lightA, lightB, pos,
+                          intencity, nullptr) -
+                 residual(SE3::exp(-delta) * baseToTracked, lightA, lightB,
+                          pos, intencity, nullptr)) /
+                (2 * h);
+    }
+    numJ[6] = (residual(baseToTracked, lightA + h, lightB, pos, intencity,
+                        nullptr) -
+               residual(baseToTracked, lightA - h, lightB, pos, intencity,
+                        nullptr)) /
+              (2 * h);
+    numJ[7] = (residual(baseToTracked, lightA, lightB + h, pos, intencity,
+                        nullptr) -
+               residual(baseToTracked, lightA, lightB - h, pos, intencity,
+                        nullptr)) /
+              (2 * h);
+
+    EXPECT_LT((numJ - J).norm(), 1e-3 * J.norm())
+        << "J = " << J.transpose() << "\nnumJ = " << numJ.transpose();
+  }
+
+  // the energy does not depend on whether the system is linearized
+  StdVector<Vec3> positions;
+  std::vector<double> baseIntencities;
+  for (int it = 0; it < testCount; ++it) {
+    positions.push_back(scene.basePos(Vec2(xs(mt), ys(mt))));
+    baseIntencities.push_back(intencities(mt));
+  }
+  std::vector<double> weights(testCount, 1.0);
+  AffineLightTransform<double> affLight(lightA, lightB);
+  const double outlierDiff = Settings::Intencity::default_outlierDiff;
+  Mat88 H;
+  Vec8 b;
+  double linearizedEnergy = accumulateTracking<CameraModel::PINHOLE>(
+      cam, tracked, positions, baseIntencities, weights, baseToTracked,
+      affLight, outlierDiff, &H, &b);
+  double energy = accumulateTracking<CameraModel::PINHOLE>(
+      cam, tracked, positions, baseIntencities, weights, baseToTracked,
+      affLight, outlierDiff, nullptr, nullptr);
+  EXPECT_EQ(linearizedEnergy, energy);
+}
+
+TEST(TrackingTest, ConvergesOnSyntheticWarp) {
+  PlaneScene scene;
+  const SE3 baseToTracked(SO3::exp(Vec3(0.01, -0.02, 0.015)),
+                          Vec3(0.1, -0.05, 0.2));
+
+  FrameTrackerSettings settings;
+  settings.pyramid.levelNum = 4;
+  StdVector<CameraModel> camPyr = scene.cam.camPyr(settings.pyramid.levelNum);
+  PreKeyFrame frame(nullptr, &scene.cam,
+                    cvtGrayToBgr(scene.render(baseToTracked)), 0,
+                    settings.pyramid);
+
+  for (bool useBilinear : {false, true}) {
+    settings.frameTracker.useBilinear = useBilinear;
+    FrameTracker tracker(camPyr, scene.baseFrame(settings.pyramid.levelNum),
+                         {}, settings);
+
+    // tracking starts from the identity, several pixels off on each level
+    auto [motion, affLight] =
+        tracker.trackFrame(frame, SE3(), AffineLightTransform<double>());
+
+    SE3 diff = motion * baseToTracked.inverse();
+    EXPECT_LT(diff.translation().norm(), 0.02) << "bilinear=" << useBilinear;
+    EXPECT_LT(diff.so3().log().norm(), 2e-3) << "bilinear=" << useBilinear;
+    EXPECT_LT(std::abs(affLight.data[0]), 0.02) << "bilinear=" << useBilinear;
+    EXPECT_LT(tracker.lastRmse, 4.0) << "bilinear=" << useBilinear;
+  }
+}
+
+TEST(TrackingTest, RecoveryKeepsTheBetterTrack) {
+  PlaneScene scene;
+  const SE3 baseToTracked(SO3::exp(Vec3(0.01, -0.02, 0.015)),
+                          Vec3(0.1, -0.05, 0.2));
+
+  FrameTrackerSettings settings;
+  settings.pyramid.levelNum = 4;
+  const int minPyrLevel = 2;
+  StdVector<CameraModel> camPyr = scene.cam.camPyr(settings.pyramid.levelNum);
+  PreKeyFrame frame(nullptr, &scene.cam,
+                    cvtGrayToBgr(scene.render(baseToTracked)), 0,
+                    settings.pyramid);
+  FrameTracker tracker(camPyr, scene.baseFrame(settings.pyramid.levelNum), {},
+                       settings);
+
+  // the first attempt starts a hundred pixels off
+  const SE3 farMotion = SE3(SO3::exp(Vec3(0, 0.25, 0)), Vec3::Zero()) *
+                        baseToTracked;
+  const SE3 nearMotion = SE3(SO3::exp(Vec3(0.004, 0, -0.004)), Vec3::Zero()) *
+                         baseToTracked;
+  auto firstAttempt =
+      tracker.trackFrame(frame, farMotion, AffineLightTransform<double>());
+  const double firstRmse = tracker.lastRmse;
+
+  auto [motion, affLight] =
+      tracker.recoverTrack(frame, {farMotion, nearMotion},
+                           AffineLightTransform<double>(), minPyrLevel,
+                           firstAttempt);
+  SE3 diff = motion * baseToTracked.inverse();
+  EXPECT_LT(diff.translation().norm(), 0.02);
+  EXPECT_LT(diff.so3().log().norm(), 2e-3);
+  EXPECT_LE(tracker.lastRmse, firstRmse);
+  EXPECT_LT(tracker.lastRmse, 4.0);
+
+  // no refined hypothesis beats a perfect first attempt, which is returned
+  // with its RMSE
+  std::pair<SE3, AffineLightTransform<double>> perfect(
+      baseToTracked, AffineLightTransform<double>(0.01, 1));
+  tracker.lastRmse = 0;
+  auto kept = tracker.recoverTrack(frame, {farMotion, nearMotion},
+                                   AffineLightTransform<double>(),
+                                   minPyrLevel, perfect);
+  EXPECT_EQ(kept.first.matrix3x4(), perfect.first.matrix3x4());
+  EXPECT_EQ(kept.second.data[0], perfect.second.data[0]);
+  EXPECT_EQ(kept.second.data[1], perfect.second.data[1]);
+  EXPECT_EQ(tracker.lastRmse, 0);
+}
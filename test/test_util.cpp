@@ -34,10 +34,19 @@ TEST(UtilTest, DepthedImagePyramid) {
   DepthedImagePyramid tst(base, Settings::Pyramid::default_levelNum, pnts, dps,
                           ws);
 
+  std::vector<cv::Mat1d> depths;
+  for (int pl = 0; pl < Settings::Pyramid::default_levelNum; ++pl) {
+    depths.emplace_back(tst[pl].rows, tst[pl].cols, -1.0);
+    for (const auto &dp : tst.depthedPixels[pl]) {
+      ASSERT_EQ(depths[pl](dp.pixel), -1.0) << "pl=" << pl << " duplicate";
+      depths[pl](dp.pixel) = dp.depth;
+    }
+  }
+
   for (int i = 0; i < pnts.size(); ++i) {
     for (int pl = 0; pl < Settings::Pyramid::default_levelNum; ++pl) {
       cv::Point p = toCvPoint(pnts[i]);
-      ASSERT_GT(tst.depths[pl](p / (1 << pl)), 0)
+      ASSERT_GT(depths[pl](p / (1 << pl)), 0)
           << "pl=" << pl << " p=" << p << " psh=" << p / (1 << pl) << " i=" << i
           << " d=" << dps[i] << " w=" << ws[i] << " porig=" << pnts[i]
           << std::endl;
@@ -45,6 +54,117 @@ TEST(UtilTest, DepthedImagePyramid) {
   }
 }
 
+TEST(UtilTest, GradMatchesFilter) {
+  const int w = 97, h = 61;
+
+  std::mt19937 mt;
+  std::uniform_int_distribution<int> idis(0, 255);
+  cv::Mat1b img(h, w);
+  for (int y = 0; y < h; ++y)
+    for (int x = 0; x < w; ++x)
+      img(y, x) = idis(mt);
+
+  cv::Mat1f gradX, gradY, gradNorm;
+  grad(img, gradX, gradY, gradNorm);
+
+  double filter[] = {-0.5, 0.0, 0.5};
+  cv::Mat1d expX, expY, expNorm;
+  cv::filter2D(img, expX, CV_64F, cv::Mat1d(1, 3, filter), cv::Point(-1, -1),
+               0, cv::BORDER_REPLICATE);
+  cv::filter2D(img, expY, CV_64F, cv::Mat1d(3, 1, filter), cv::Point(-1, -1),
+               0, cv::BORDER_REPLICATE);
+  cv::magnitude(expX, expY, expNorm);
+
+  for (int y = 0; y < h; ++y)
+    for (int x = 0; x < w; ++x) {
+      ASSERT_EQ(gradX(y, x), expX(y, x)) << "x=" << x << " y=" << y;
+      ASSERT_EQ(gradY(y, x), expY(y, x)) << "x=" << x << " y=" << y;
+      ASSERT_NEAR(gradNorm(y, x), expNorm(y, x), 1e-4)
+          << "x=" << x << " y=" << y;
+    }
+}
+
+TEST(UtilTest, ImagePyramidMatchesScalar) {
+  const int w = 203, h = 131, levelNum = Settings::Pyramid::default_levelNum;
+
+  std::mt19937 mt;
+  std::uniform_int_distribution<int> idis(0, 255);
+  cv::Mat1b img(h, w);
+  for (int y = 0; y < h; ++y)
+    for (int x = 0; x < w; ++x)
+      img(y, x) = idis(mt);
+
+  ImagePyramid pyr(img, levelNum);
+
+  cv::Mat1b expected = img;
+  for (int lvl = 1; lvl < levelNum; ++lvl) {
+    cv::Mat1b next(expected.rows / 2, expected.cols / 2);
+    for (int y = 0; y < next.rows; ++y)
+      for (int x = 0; x < next.cols; ++x)
+        next(y, x) = (expected(2 * y, 2 * x) + expected(2 * y, 2 * x + 1) +
+                      expected(2 * y + 1, 2 * x) +
+                      expected(2 * y + 1, 2 * x + 1)) /
+                     4;
+    expected = next;
+
+    ASSERT_EQ(pyr[lvl].size(), expected.size()) << "lvl=" << lvl;
+    for (int y = 0; y < expected.rows; ++y)
+      for (int x = 0; x < expected.cols; ++x)
+        ASSERT_EQ(pyr[lvl](y, x), expected(y, x))
+            << "lvl=" << lvl << " x=" << x << " y=" << y;
+  }
+
+  // levels are views into the padded storage, whose border replicates them
+  const int b = ImagePyramid::border;
+  for (int lvl = 0; lvl < levelNum; ++lvl) {
+    const cv::Mat1b &level = pyr[lvl], &padded = pyr.paddedImages[lvl];
+    ASSERT_EQ(padded.rows, level.rows + 2 * b);
+    ASSERT_EQ(padded.cols, level.cols + 2 * b);
+    ASSERT_EQ(&padded(b, b), &level(0, 0));
+    for (int y = 0; y < padded.rows; ++y)
+      for (int x = 0; x < padded.cols; ++x)
+        ASSERT_EQ(padded(y, x), level(std::clamp(y - b, 0, level.rows - 1),
+                                      std::clamp(x - b, 0, level.cols - 1)))
+            << "lvl=" << lvl << " x=" << x << " y=" << y;
+  }
+}
+
+TEST(UtilTest, PatternEnergiesMatchScalar) {
+  const double outlierDiff = Settings::Intencity::default_outlierDiff;
+
+  std::mt19937 mt;
+  std::uniform_real_distribution<double> intencity(0, 255);
+  std::uniform_real_distribution<double> residual(-3 * outlierDiff,
+                                                  3 * outlierDiff);
+
+  // position counts not divisible by the vector width check the scalar tail
+  for (int patternSize = 1; patternSize <= Settings::ResidualPattern::max_size;
+       ++patternSize)
+    for (int numPositions : {1, 2, 3, 5, 8, 37}) {
+      std::vector<double> intencities(patternSize);
+      for (double &i : intencities)
+        i = intencity(mt);
+      std::vector<double> sampled(patternSize * numPositions);
+      for (int i = 0; i < patternSize; ++i)
+        for (int k = 0; k < numPositions; ++k)
+          sampled[i * numPositions + k] = intencities[i] + residual(mt);
+
+      std::vector<double> energies(numPositions);
+      patternEnergies(intencities.data(), sampled.data(), patternSize,
+                      numPositions, outlierDiff, energies.data());
+
+      std::vector<double> position(patternSize);
+      for (int k = 0; k < numPositions; ++k) {
+        for (int i = 0; i < patternSize; ++i)
+          position[i] = sampled[i * numPositions + k];
+        EXPECT_EQ(energies[k], patternEnergy(intencities.data(),
+                                             position.data(), patternSize,
+                                             outlierDiff))
+            << "pattern size = " << patternSize << " position = " << k;
+      }
+    }
+}
+
 TEST(UtilTest, PlyHolderTriv) {
   const int pntCount = 5;
   const std::string fname = "tst.ply";